@@ -0,0 +1,248 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "integration.h"
+#include "cache_file.h"
+#include "context.h"
+
+#define CACHE_MAGIC "WMCACHE"
+#define CACHE_VERSION 1
+
+/*
+ * The file is a header followed by fixed-size records. Records are only 
+ * ever appended, each with a single write on a descriptor opened with 
+ * O_APPEND, so the worker threads need no coordination. A record cut short
+ * by a crash fails its check and is skipped.
+ */
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct cache_record {
+    uint32_t table;
+    uint32_t pad;
+    uint64_t settings;
+    memo_key_t key;
+    double value;
+    double tol;
+    uint64_t check;
+};
+
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size)
+{
+    const unsigned char *c = data;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        h ^= c[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+#define hash_field(h, f) hash_bytes(h, &(f), sizeof(f))
+
+
+// Everything that changes which estimate an integral gets.
+static uint64_t settings_hash(const integration_settings_t *s)
+{
+    const char *name = integration_name(s);
+    uint64_t h = HASH_INIT;
+
+    h = hash_bytes(h, name, strlen(name));
+    h = hash_field(h, s->calls);
+    h = hash_field(h, s->seed);
+    h = hash_field(h, s->shifts);
+    h = hash_field(h, s->tol_rel);
+    h = hash_field(h, s->conditional);
+    return h;
+}
+
+
+static uint64_t record_check(struct cache_record *r)
+{
+    return hash_bytes(HASH_INIT, r, offsetof(struct cache_record, check));
+}
+
+
+// A stored value is kept over another one if it was computed more tightly.
+static int tighter(double tol, double other)
+{
+    return other != 0 && (tol == 0 || tol < other);
+}
+
+
+// Called with the load mutex held; the tables count against the memos.
+static void load(cache_file_t *c)
+{
+    struct cache_record *r;
+    double value, tol;
+    char *map;
+    off_t off;
+
+    if (c->loaded_size <= sizeof(struct cache_header))
+        return;
+    map = mmap(NULL, c->loaded_size, PROT_READ, MAP_SHARED, c->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("cache file");
+        return;
+    }
+
+    for (off = sizeof(struct cache_header); 
+            off + sizeof(struct cache_record) <= c->loaded_size; 
+            off += sizeof(struct cache_record)) {
+        r = (struct cache_record *) (map + off);
+        if (r->settings != c->settings || r->table >= CACHE_TABLES ||
+                r->check != record_check(r))
+            continue;
+        if (memo_lookup(&c->table[r->table], &r->key, &value, &tol) &&
+                !tighter(r->tol, tol))
+            continue;
+        memo_keep(&c->table[r->table], &r->key, r->value, r->tol);
+    }
+    munmap(map, c->loaded_size);
+}
+
+
+void cache_file_init(cache_file_t *c)
+{
+    int i;
+
+    c->fd = -1;
+    c->loaded_size = 0;
+    c->settings = 0;
+    pthread_mutex_init(&c->load_mutex, NULL);
+    c->loaded = 0;
+    for (i = 0; i < CACHE_TABLES; i++) {
+        pthread_mutex_init(&c->table[i].mutex, NULL);
+        c->table[i].table = NULL;
+        c->table[i].file_table = -1;
+    }
+    c->hits = 0;
+    c->appends = 0;
+}
+
+
+int cache_file_open(cache_file_t *c, const char *path, 
+        const integration_settings_t *s)
+{
+    struct cache_header header, expected = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .record_size = sizeof(struct cache_record)
+    };
+    struct stat st;
+
+    c->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (c->fd < 0 || fstat(c->fd, &st) < 0) {
+        perror(path);
+        cache_file_close(c);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        if (write(c->fd, &expected, sizeof(expected)) != sizeof(expected)) {
+            perror(path);
+            cache_file_close(c);
+            return -1;
+        }
+    } else if (pread(c->fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(&header, &expected, sizeof(header)) != 0) {
+        fprintf(stderr, "%s: not a cache file of this version, "
+                "not using it\n", path);
+        cache_file_close(c);
+        return -1;
+    }
+
+    c->loaded_size = st.st_size;
+    c->settings = settings_hash(s);
+    return 0;
+}
+
+
+void cache_file_close(cache_file_t *c)
+{
+    int i;
+
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    for (i = 0; i < CACHE_TABLES; i++)
+        memo_free(&c->table[i]);
+    c->loaded = 0;
+}
+
+
+int cache_file_lookup(int table, memo_key_t *key, double *value, 
+        double *tol)
+{
+    cache_file_t *c = &context()->cache;
+
+    if (c->fd < 0)
+        return 0;
+    if (!__atomic_load_n(&c->loaded, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&c->load_mutex);
+        if (!c->loaded)
+            load(c);
+        __atomic_store_n(&c->loaded, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&c->load_mutex);
+    }
+    if (!memo_lookup(&c->table[table], key, value, tol))
+        return 0;
+    __atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+void cache_file_append(int table, memo_key_t *key, double value, 
+        double tol)
+{
+    cache_file_t *c = &context()->cache;
+    struct cache_record r;
+
+    if (c->fd < 0)
+        return;
+
+    memset(&r, 0, sizeof(r));
+    r.table = table;
+    r.settings = c->settings;
+    r.key = *key;
+    r.value = value;
+    r.tol = tol;
+    r.check = record_check(&r);
+    if (write(c->fd, &r, sizeof(r)) == sizeof(r))
+        __atomic_add_fetch(&c->appends, 1, __ATOMIC_RELAXED);
+}
+
@@ -0,0 +1,73 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#ifndef __CACHE_FILE_H
+#define __CACHE_FILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "memo.h"
+#include "integration.h"
+
+// the memos kept in the cache file
+enum cache_table {
+    CACHE_AN_BN,
+    CACHE_AN_BN1,
+    CACHE_BN_AN,
+    CACHE_BN1_AN,
+    CACHE_CHAIN_BN,
+    CACHE_CHAIN_AN,
+    CACHE_TABLES
+};
+
+// a cache file as opened by a context
+struct cache_file {
+    int fd; // -1 if closed
+    off_t loaded_size;
+    uint64_t settings; // hash of the settings it was opened with
+
+    pthread_mutex_t load_mutex;
+    int loaded; // the records were read into table
+    memo_t table[CACHE_TABLES];
+
+    unsigned long hits, appends;
+};
+typedef struct cache_file cache_file_t;
+
+void cache_file_init(cache_file_t *c);
+
+/*
+ * Opens, or creates, the cache file shared by successive runs. It is read 
+ * on the first lookup, keeping the records computed with settings s, into
+ * tables counted against the memos of the context. Call once the settings
+ * are final. Returns -1 on failure, leaving the cache disabled.
+ */
+int cache_file_open(cache_file_t *c, const char *path, 
+        const integration_settings_t *s);
+// Frees the tables read in; the context must be bound to the caller.
+void cache_file_close(cache_file_t *c);
+
+// Go to the cache file of the context bound to the caller.
+int cache_file_lookup(int table, memo_key_t *key, double *value, 
+        double *tol);
+void cache_file_append(int table, memo_key_t *key, double value, 
+        double tol);
+
+#endif
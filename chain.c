@@ -19,6 +19,7 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <gsl/gsl_math.h>
 #include <assert.h>
 #include <pthread.h>
@@ -26,127 +27,179 @@
 #include "wildmac.h"
 #include "probability.h"
 #include "probability_chain.h"
-#include "hashtable.h"
-#include "hashkeys.h"
+#include "memo.h"
+#include "integration.h"
+#include "context.h"
+
+// chain integrals entering contact_union and union_funcg at each level
+#define LEVEL_TERMS 10
 
-static double union_funcg(int n, protocol_params_t *p);
 static double intersect_funcg(int n, int s, protocol_params_t *p);
 
 
+/*
+ * Error budget of a chain integral at level n that enters the recurrence 
+ * multiplied by coef. Level n receives 6 / (PI^2 (n + 1)^2) of the accuracy
+ * target, so that the levels sum to at most the target, and splits it 
+ * evenly between its terms. Terms with small coefficients, typically those
+ * of levels where contact is already likely, get loose targets.
+ */
+static double term_tolerance(int n, double coef)
+{
+    double accuracy = context()->integration.accuracy, share;
+
+    if (accuracy <= 0)
+        return 0;
+
+    share = accuracy * 6 / M_PI / M_PI / (n + 1) / (n + 1) / 
+        LEVEL_TERMS;
+    if (coef == 0)
+        return 1;
+    return share / fabs(coef);
+}
+
+
 double probability_contact(int n, protocol_params_t *p)
 {
     double res = 0;
     if (n == 0) {
         res += probability_slot0(p);
         res += probability_slotm1(p);
-        res -= probability_bnk_bn(0, 1, p);
+        res -= probability_bnk_bn(0, 1, p, 0);
         return res;
     }
     res += probability_slotn(p);
     res += probability_slotn1(p);
-    res -= probability_bnk_bn(n, 1, p);
+    res -= probability_bnk_bn(n, 1, p, 0);
     return res;
 }
 
 
-double contact_union(int n, protocol_params_t *p)
+/*
+ * contact_union and union_funcg at level n only look back three levels, so
+ * both are filled bottom-up, union_funcg first, in arrays kept per thread.
+ * A call for the parameters of the previous one resumes from the levels 
+ * already there; other parameters start over in the same arrays.
+ */
+struct union_levels {
+    unsigned long context; // id of the context they were computed in
+    double tau, lambda;
+    int samples;
+    int count; // levels filled
+    int size;
+    double *contact; // contact_union
+    double *funcg; // union_funcg
+};
+
+static __thread struct union_levels levels;
+
+
+static inline double level(double *v, int n)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
-    
-    double r = 0;
+    return n < 0 ? 0 : v[n];
+}
+
+
+static double union_funcg(struct union_levels *l, int n, 
+        protocol_params_t *p)
+{
+    double r = 0, coef;
     int i;
 
-    if (n < 0) 
-        return 0;
-    
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
+    r += level(l->contact, n - 1);
+
+    if (n == 0)
+        r += probability_a0_bm1(p);
+    else
+        r += probability_an_bn1(p) * (1 - level(l->funcg, n - 1));
+
+    for (i = 1; i <= 2; i++) {
+        coef = level(l->contact, n - i - 1) - 1;
+        r += coef * probability_ank_an(n, i, p, term_tolerance(n, coef));
+    }
     
-    hash_key = create_key_protocol_nk(p, n, n); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
+    for (i = 1; i <= 3; i++) {
+        coef = 1 - level(l->funcg, n - i);
+        r += coef * probability_bnk_an(n, i, p, term_tolerance(n, coef));
     }
+    return r;
+}
+
+
+static double union_contact(struct union_levels *l, int n, 
+        protocol_params_t *p)
+{
+    double r = 0, coef;
+    int i;
 
-    r += union_funcg(n, p);
+    r += l->funcg[n];
 
     if (n == 0)
         r += probability_b0_a0(p);
     else
-        r += probability_bn_an(p) * (1 - contact_union(n - 1, p)); 
-    
-    for (i = 0; i <= 2; i++) 
-        r += (1 - contact_union(n - i - 1, p)) * probability_ank_bn(n, i, p);
+        r += probability_bn_an(p) * (1 - level(l->contact, n - 1)); 
     
-    for (i = 1; i <= 2; i++) 
-        r += (union_funcg(n - i, p) - 1) * probability_bnk_bn(n, i, p);
+    for (i = 0; i <= 2; i++) {
+        coef = 1 - level(l->contact, n - i - 1);
+        r += coef * probability_ank_bn(n, i, p, term_tolerance(n, coef));
+    }
     
-    hash_res = malloc(sizeof(double));
-    *hash_res = r;
-    hashtable_insert(hash_table, hash_key, hash_res);
-
+    for (i = 1; i <= 2; i++) {
+        coef = level(l->funcg, n - i) - 1;
+        r += coef * probability_bnk_bn(n, i, p, term_tolerance(n, coef));
+    }
     return r;
 }
 
 
-static double union_funcg(int n, protocol_params_t *p)
+double contact_union(int n, protocol_params_t *p)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
-    
-    double r = 0;
-    int i;
+    struct union_levels *l = &levels;
+    unsigned long id = context()->id;
+    int m;
 
     if (n < 0) 
         return 0;
-    
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
-    
-    hash_key = create_key_protocol_nk(p, n, n); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
+
+    if (l->context != id || l->tau != p->tau || l->lambda != p->lambda || 
+            l->samples != p->samples) {
+        l->context = id;
+        l->tau = p->tau;
+        l->lambda = p->lambda;
+        l->samples = p->samples;
+        l->count = 0;
     }
 
-    r += contact_union(n - 1, p);
+    if (n >= l->size) {
+        l->size = n + 1 > 2 * l->size ? n + 1 : 2 * l->size;
+        l->contact = realloc(l->contact, l->size * sizeof(double));
+        l->funcg = realloc(l->funcg, l->size * sizeof(double));
+        assert(l->contact != NULL && l->funcg != NULL);
+    }
 
-    if (n == 0)
-        r += probability_a0_bm1(p);
-    else
-        r += probability_an_bn1(p) * (1 - union_funcg(n - 1, p));
+    for (m = l->count; m <= n; m++) {
+        l->funcg[m] = union_funcg(l, m, p);
+        l->contact[m] = union_contact(l, m, p);
+    }
+    if (l->count <= n)
+        l->count = n + 1;
 
-    for (i = 1; i <= 2; i++)
-        r += probability_ank_an(n, i, p) * (contact_union(n - i - 1, p) - 1);
-    
-    for (i = 1; i <= 3; i++) 
-        r += probability_bnk_an(n, i, p) * (1 - union_funcg(n - i, p));
-    
-    hash_res = malloc(sizeof(double));
-    *hash_res = r;
-    hashtable_insert(hash_table, hash_key, hash_res);
+    return l->contact[n];
+}
 
-    return r;
+
+void contact_union_free()
+{
+    free(levels.contact);
+    free(levels.funcg);
+    memset(&levels, 0, sizeof(levels));
 }
 
 
 double contact_intersect(int n, int s, protocol_params_t *p)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
+    memo_t *memo = memo_get(MEMO_INTERSECT);
+    memo_key_t key;
     
     double r = 0;
     int i, sign;
@@ -154,17 +207,9 @@ double contact_intersect(int n, int s, protocol_params_t *p)
     if (n < s) 
         return 0;
 
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
-    
-    hash_key = create_key_protocol_nk(p, n, n); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
-    }
+    memo_key_nk(&key, p, n, n); 
+    if (memo_lookup(memo, &key, &r, NULL))
+        return r;
 
     if (n == 0)
         r += probability_slot0(p);
@@ -177,16 +222,14 @@ double contact_intersect(int n, int s, protocol_params_t *p)
     r += intersect_funcg(n, s, p);
     
     for (i = 1, sign = -1; n - i >= s && i <= 2; i++, sign *= -1) 
-        r += sign * probability_ank_bn(n, i, p) * 
+        r += sign * probability_ank_bn(n, i, p, 0) * 
             contact_intersect(n - i - 1, s, p);
     
     for (i = 1, sign = -1; n - i >= s - 1 && i <= 2; i++, sign *= -1) 
-        r += sign * probability_bnk_bn(n, i, p) * 
+        r += sign * probability_bnk_bn(n, i, p, 0) * 
             intersect_funcg(n - i, s, p);
     
-    hash_res = malloc(sizeof(double));
-    *hash_res = r;
-    hashtable_insert(hash_table, hash_key, hash_res);
+    memo_store(memo, &key, r, 0);
 
     return r;
 }
@@ -194,10 +237,8 @@ double contact_intersect(int n, int s, protocol_params_t *p)
 
 static double intersect_funcg(int n, int s, protocol_params_t *p)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
+    memo_t *memo = memo_get(MEMO_INTERSECT_FUNCG);
+    memo_key_t key;
     
     double r = 0;
     int i, sign;
@@ -207,17 +248,9 @@ static double intersect_funcg(int n, int s, protocol_params_t *p)
     if (n == s - 1)
         return 1;
     
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
-    
-    hash_key = create_key_protocol_nk(p, n, n); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
-    }
+    memo_key_nk(&key, p, n, n); 
+    if (memo_lookup(memo, &key, &r, NULL))
+        return r;
 
     if (n == 0)
         r += probability_slotm1(p); 
@@ -225,14 +258,13 @@ static double intersect_funcg(int n, int s, protocol_params_t *p)
         r += intersect_funcg(n - 1, s, p) * probability_slotn1(p);
 
     for (i = 1, sign = 1; n - i >= s && i <= 2; i++, sign *= -1)
-        r += probability_ank_an(n, i, p) * contact_intersect(n - i - 1, s, p);
+        r += probability_ank_an(n, i, p, 0) * 
+            contact_intersect(n - i - 1, s, p);
 
     for (i = 2, sign = -1; n - i >= s - 1&& i <= 3; i++, sign *= -1)
-        r += probability_bnk_an(n, i, p) * intersect_funcg(n - i, s, p);
+        r += probability_bnk_an(n, i, p, 0) * intersect_funcg(n - i, s, p);
     
-    hash_res = malloc(sizeof(double));
-    *hash_res = r;
-    hashtable_insert(hash_table, hash_key, hash_res);
+    memo_store(memo, &key, r, 0);
 
     return r;
 }
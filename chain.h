@@ -24,5 +24,7 @@
 
 double probability_contact(int n, protocol_params_t *p);
 double contact_union(int n, protocol_params_t *p);
+// Frees the levels contact_union keeps for the calling thread.
+void contact_union_free();
 
 #endif
@@ -0,0 +1,268 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#include <stdlib.h>
+#include <assert.h>
+#include <gsl/gsl_math.h>
+
+#include "wildmac.h"
+#include "integrands.h"
+#include "chain_sampler.h"
+
+#define SUB_BLOCK 64
+
+/*
+ * Sequential conditional sampling of the chain integrands. The factors are
+ * visited in order; b and c are drawn uniformly on their support (clipped
+ * to the box) and the remaining variable only where the factor's argument 
+ * lies in [0, 2 PI]. The weight of a sample is the product of the lengths 
+ * of these ranges, scaled by the densities, so every sample consistent 
+ * with the box contributes, instead of the few a uniform draw over the 
+ * whole box would hit. u lives in the unit cube, one coordinate per 
+ * variable, so any backend can drive the sampler.
+ */
+
+// support of a slot variable in period n - j
+static void level_support(int n, int j, protocol_params_t *p, double *lo, 
+        double *hi)
+{
+    *lo = 2 * (n - j) * M_PI;
+    *hi = 2 * (n - j + 1) * M_PI - p->on;
+}
+
+
+static int clip(double *lo, double *hi, double box_lo, double box_hi)
+{
+    if (*lo < box_lo)
+        *lo = box_lo;
+    if (*hi > box_hi)
+        *hi = box_hi;
+    return *hi > *lo;
+}
+
+
+static struct chain_factor *add_factor(chain_sampler_t *s, int var, int sign,
+        int next, int n, int level, protocol_params_t *p)
+{
+    struct chain_factor *f = &s->factor[s->factors++];
+    double w = 2 * M_PI - p->on;
+
+    assert(s->factors <= CHAIN_MAX_FACTORS);
+
+    f->var = var;
+    f->sign = sign;
+    f->b = var + 1;
+    f->c = var + 2;
+    f->terms = 0;
+
+    // a factor across two periods takes b from the previous one
+    level_support(n, next ? level + 1 : level, p, &f->b_lo, &f->b_hi);
+    level_support(n, level, p, &f->c_lo, &f->c_hi);
+    if (!clip(&f->b_lo, &f->b_hi, s->xl[f->b], s->xu[f->b]) ||
+            !clip(&f->c_lo, &f->c_hi, s->xl[f->c], s->xu[f->c]))
+        s->scale = 0;
+    s->scale *= (f->b_hi - f->b_lo) / w * (f->c_hi - f->c_lo) / w / 2 / M_PI;
+    return f;
+}
+
+
+static void add_term(struct chain_factor *f, int var, int sign)
+{
+    assert(f->terms < CHAIN_MAX_TERMS);
+    f->term[f->terms] = var;
+    f->term_sign[f->terms++] = sign;
+}
+
+
+/*
+ * Stage t of integrand_chain_an/bn (t = 1..k) opens t - 1 inner triples, 
+ * whose first variable is new, and closes with a factor whose argument 
+ * chains x[0], the closing variables of the earlier stages and the inner 
+ * variables with alternating signs. m counts inner triples from the last.
+ * Returns the number of leading orders whose integral does not vanish.
+ */
+int chain_sampler_init(chain_sampler_t *s, int an, int n, int k, 
+        protocol_params_t *p, double *xl, double *xu)
+{
+    struct chain_factor *f;
+    int t, m, base, inner;
+
+    s->factors = 0;
+    s->xl = xl;
+    s->xu = xu;
+    s->scale = 1;
+    s->stages = k;
+
+    assert(k <= CHAIN_MAX_STAGES);
+    for (t = 1; t <= k; t++) {
+        base = 3 * (t - 1) * t / 2;
+        inner = t - 1;
+
+        for (m = inner - 1; m >= 0; m--) {
+            if (an)
+                add_factor(s, base + 3 * (inner - 1 - m), 1, m % 2, n,
+                        m / 2 + 1, p);
+            else
+                add_factor(s, base + 3 * (inner - 1 - m), 1, m % 2 == 0, n,
+                        (m + 1) / 2, p);
+        }
+
+        f = add_factor(s, base + 3 * inner, t % 2 ? 1 : -1, an, n, 0, p);
+        s->stage_end[t - 1] = s->factors;
+        s->stage_scale[t - 1] = s->scale;
+        if (t == 1)
+            continue;
+        add_term(f, 0, 1);
+        for (m = 2; m < t; m++)
+            add_term(f, 3 * (m - 1) * m / 2 + 3 * (m - 1), m % 2 ? 1 : -1);
+        for (m = 0; m < inner; m++)
+            add_term(f, base + 3 * (inner - 1 - m), m % 2 ? -1 : 1);
+    }
+
+    for (t = 0; t < k && s->stage_scale[t] > 0; t++)
+        ;
+    return t;
+}
+
+
+// range of x[f->var] keeping the argument of f, rest + sign * x, in range
+static inline double free_range(struct chain_factor *f, double rest, 
+        double box_lo, double box_hi, double *lo)
+{
+    double hi;
+
+    if (f->sign > 0) {
+        *lo = -rest;
+        hi = 2 * M_PI - rest;
+    } else {
+        *lo = rest - 2 * M_PI;
+        hi = rest;
+    }
+    if (*lo < box_lo)
+        *lo = box_lo;
+    if (hi > box_hi)
+        hi = box_hi;
+    return hi > *lo ? hi - *lo : 0;
+}
+
+
+double chain_sampler_weight(double *u, size_t dim, void *params)
+{
+    chain_sampler_t *s = (chain_sampler_t *) params;
+    struct chain_factor *f;
+    double x[3 * CHAIN_MAX_FACTORS];
+    double weight = s->scale, rest, lo, len;
+    int i, j;
+
+    for (i = 0; i < s->factors; i++) {
+        f = &s->factor[i];
+        x[f->b] = f->b_lo + u[f->b] * (f->b_hi - f->b_lo);
+        x[f->c] = f->c_lo + u[f->c] * (f->c_hi - f->c_lo);
+
+        rest = x[f->c] - x[f->b];
+        for (j = 0; j < f->terms; j++)
+            rest += f->term_sign[j] * x[f->term[j]];
+
+        len = free_range(f, rest, s->xl[f->var], s->xu[f->var], &lo);
+        if (len == 0)
+            return 0;
+        x[f->var] = lo + u[f->var] * len;
+        weight *= len;
+    }
+    return weight;
+}
+
+
+/*
+ * Weights of the orders from first + 1 up, order first + 1 + t going to 
+ * out[t * stride + i].
+ */
+static inline void weight_batch(chain_sampler_t *s, int first, 
+        const double *u, size_t stride, size_t count, double *out)
+{
+    struct chain_factor *f;
+    double x[3 * CHAIN_MAX_FACTORS][SUB_BLOCK];
+    double rest[SUB_BLOCK], weight[SUB_BLOCK];
+    size_t start, size, i;
+    int l, j, t;
+
+    for (start = 0; start < count; start += size) {
+        size = count - start < SUB_BLOCK ? count - start : SUB_BLOCK;
+
+        for (i = 0; i < size; i++)
+            weight[i] = 1;
+
+        for (l = 0, t = 0; l < s->factors; l++) {
+            const double *ub, *uc, *uv;
+            double box_lo, box_hi;
+
+            f = &s->factor[l];
+            ub = u + f->b * stride + start;
+            uc = u + f->c * stride + start;
+            uv = u + f->var * stride + start;
+            box_lo = s->xl[f->var];
+            box_hi = s->xu[f->var];
+
+            for (i = 0; i < size; i++) {
+                x[f->b][i] = f->b_lo + ub[i] * (f->b_hi - f->b_lo);
+                x[f->c][i] = f->c_lo + uc[i] * (f->c_hi - f->c_lo);
+                rest[i] = x[f->c][i] - x[f->b][i];
+            }
+            for (j = 0; j < f->terms; j++) {
+                double *xt = x[f->term[j]];
+                double sign = f->term_sign[j];
+                for (i = 0; i < size; i++)
+                    rest[i] += sign * xt[i];
+            }
+            for (i = 0; i < size; i++) {
+                double lo, len;
+
+                len = free_range(f, rest[i], box_lo, box_hi, &lo);
+                x[f->var][i] = lo + uv[i] * len;
+                weight[i] *= len;
+            }
+
+            if (l + 1 < s->stage_end[t])
+                continue;
+            if (t >= first)
+                for (i = 0; i < size; i++)
+                    out[(t - first) * stride + start + i] = 
+                        weight[i] * s->stage_scale[t];
+            t++;
+        }
+    }
+}
+
+
+SIMD_CLONES
+void chain_sampler_weight_batch(const double *u, size_t stride, size_t count,
+        void *params, double *out)
+{
+    chain_sampler_t *s = (chain_sampler_t *) params;
+
+    weight_batch(s, s->stages - 1, u, stride, count, out);
+}
+
+
+SIMD_CLONES
+void chain_sampler_prefix_batch(const double *u, size_t stride, size_t count,
+        void *params, double *out)
+{
+    weight_batch((chain_sampler_t *) params, 0, u, stride, count, out);
+}
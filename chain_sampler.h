@@ -0,0 +1,71 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#ifndef __CHAIN_SAMPLER_H
+#define __CHAIN_SAMPLER_H
+
+#include <stddef.h>
+#include "wildmac.h"
+
+#define CHAIN_MAX_STAGES 5
+#define CHAIN_MAX_FACTORS 15
+#define CHAIN_MAX_TERMS 8
+
+/*
+ * One pdfx factor of a chain integrand: the densities of variables b and c
+ * times the density of its argument, 
+ *     sign * x[var] + sum(term_sign[i] * x[term[i]]) - x[b] + x[c],
+ * on [0, 2 PI]. var is the only variable not fixed by earlier factors.
+ */
+struct chain_factor {
+    int var;
+    int sign;
+    int b, c;
+    double b_lo, b_hi;
+    double c_lo, c_hi;
+    int terms;
+    int term[CHAIN_MAX_TERMS];
+    int term_sign[CHAIN_MAX_TERMS];
+};
+
+/*
+ * The chain of order k is a prefix of that of order k + 1: stage t ends 
+ * after stage_end[t] factors and scales its weight by stage_scale[t].
+ */
+struct chain_sampler {
+    int factors;
+    struct chain_factor factor[CHAIN_MAX_FACTORS];
+    int stages;
+    int stage_end[CHAIN_MAX_STAGES];
+    double stage_scale[CHAIN_MAX_STAGES];
+    double *xl, *xu;
+    double scale;
+};
+typedef struct chain_sampler chain_sampler_t;
+
+int chain_sampler_init(chain_sampler_t *s, int an, int n, int k, 
+        protocol_params_t *p, double *xl, double *xu);
+double chain_sampler_weight(double *u, size_t dim, void *params);
+void chain_sampler_weight_batch(const double *u, size_t stride, size_t count,
+        void *params, double *out);
+// the weights of all orders 1..k, order t + 1 in out[t * stride + i]
+void chain_sampler_prefix_batch(const double *u, size_t stride, size_t count,
+        void *params, double *out);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+
+/*
+ * Checks the closed form of the basic slot probabilities against their 
+ * Monte Carlo integrals, over a grid of periods, samples and taus. A value
+ * fails if the two differ by more than CHECK_SIGMAS times the largest 
+ * error estimated for the integrals of its configuration.
+ */
+#include <stdio.h>
+#include <gsl/gsl_math.h>
+
+#include "wildmac.h"
+#include "context.h"
+#include "probability.h"
+
+#define CHECK_CALLS 1000000
+#define CHECK_SIGMAS 5
+
+static const char *names[] = { "an_bn", "an_bn1", "bn_an", "bn1_an" };
+
+
+static void slot_probabilities(protocol_params_t *p, double *res)
+{
+    res[0] = probability_an_bn(p);
+    res[1] = probability_an_bn1(p);
+    res[2] = probability_bn_an(p);
+    res[3] = probability_bn1_an(p);
+}
+
+
+// Returns the number of probabilities of p that fail the check.
+static int check_params(protocol_params_t *p, double T)
+{
+    context_t *exact, *mc, *outer;
+    double closed[4], sampled[4], bound;
+    int i, failed = 0;
+
+    exact = context_create();
+    mc = context_create();
+    mc->integration.exact_slots = 0;
+    mc->integration.calls = CHECK_CALLS;
+
+    outer = context_enter(exact);
+    slot_probabilities(p, closed);
+    context_enter(mc);
+    slot_probabilities(p, sampled);
+    context_enter(outer);
+
+    bound = CHECK_SIGMAS * mc->stats.max_err;
+    for (i = 0; i < 4; i++) {
+        if (fabs(closed[i] - sampled[i]) <= bound)
+            continue;
+        printf("T %g samples %d tau %f: %s closed %f, sampled %f +- %f\n",
+                T, p->samples, p->tau, names[i], closed[i], sampled[i], 
+                bound);
+        failed++;
+    }
+
+    context_destroy(exact);
+    context_destroy(mc);
+    return failed;
+}
+
+
+int main()
+{
+    double periods[] = { 20000, 100000, 500000 };
+    int samples[] = { 1, 4, 8 };
+    double steps[] = { .1, .5, .9 };
+    protocol_params_t p;
+    double lb, ub;
+    int i, j, k, checked = 0, failed = 0;
+
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 3; j++)
+            for (k = 0; k < 3; k++) {
+                p.lambda = get_lambda(periods[i]);
+                p.samples = samples[j];
+                lb = fmax(2 * p.lambda, 2 * M_PI * MINttx / periods[i]);
+                ub = (M_PI - p.lambda) / (p.samples + 1);
+                if (ub <= lb)
+                    continue;
+                p.tau = lb + steps[k] * (ub - lb);
+                SET_ON(&p);
+                SET_ACTIVE(&p);
+                failed += check_params(&p, periods[i]);
+                checked += 4;
+            }
+
+    printf("%d of %d slot probabilities differ from their integrals\n", 
+            failed, checked);
+    return failed != 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#include <stdlib.h>
+#include <assert.h>
+
+#include "context.h"
+
+static __thread context_t *current;
+static unsigned long next_id = 1;
+
+
+context_t *context_create()
+{
+    context_t *ctx = calloc(1, sizeof(context_t));
+
+    if (ctx == NULL)
+        return NULL;
+    ctx->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    integration_defaults(&ctx->integration);
+    solver_defaults(&ctx->solver);
+    memo_set_init(&ctx->memos);
+    cache_file_init(&ctx->cache);
+    pthread_mutex_init(&ctx->stats.mutex, NULL);
+    pthread_mutex_init(&ctx->mutex, NULL);
+    return ctx;
+}
+
+
+void context_destroy(context_t *ctx)
+{
+    context_t *outer;
+
+    if (ctx == NULL)
+        return;
+
+    outer = context_enter(ctx);
+    solver_shutdown(ctx);
+    cache_file_close(&ctx->cache);
+    memo_set_free(&ctx->memos);
+    context_enter(outer != ctx ? outer : NULL);
+
+    pthread_mutex_destroy(&ctx->stats.mutex);
+    pthread_mutex_destroy(&ctx->mutex);
+    free(ctx);
+}
+
+
+context_t *context_enter(context_t *ctx)
+{
+    context_t *outer = current;
+
+    current = ctx;
+    return outer;
+}
+
+
+context_t *context()
+{
+    assert(current != NULL);
+    return current;
+}
@@ -0,0 +1,62 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#ifndef __CONTEXT_H
+#define __CONTEXT_H
+
+#include <pthread.h>
+#include <sys/time.h>
+#include "integration.h"
+#include "memo.h"
+#include "cache_file.h"
+#include "solver.h"
+
+/*
+ * Everything a solve reads or keeps between calls: the settings, the memos,
+ * the statistics and the workers. Solves on different contexts run 
+ * independently; calls on the same context take turns. The threads working
+ * for a context, the caller included, find it through context().
+ */
+struct context {
+    unsigned long id; // unique for the life of the process
+    integration_settings_t integration;
+    solver_settings_t solver;
+    int verbose; // progress on stdout
+
+    memo_set_t memos;
+    cache_file_t cache; // closed unless opened by the user
+    integration_stats_t stats;
+
+    pthread_mutex_t mutex; // held by the call in progress
+    struct worker_pool *workers; // started on first use
+    struct timeval deadline;
+    int has_deadline, expired;
+};
+typedef struct context context_t;
+
+// A quiet context with the default settings, NULL if out of memory.
+context_t *context_create();
+// Stops the workers and frees the memos of ctx.
+void context_destroy(context_t *ctx);
+
+// Binds ctx to the calling thread and returns the one bound before.
+context_t *context_enter(context_t *ctx);
+context_t *context();
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+
+#include "cpus.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+
+#ifdef __linux__
+/*
+ * CPUs granted by the quota of a cgroup v2 directory, 0 if none; cpu.max 
+ * holds "max PERIOD" or "QUOTA PERIOD".
+ */
+static double quota_v2(const char *dir)
+{
+    char path[PATH_MAX + 32], max[32];
+    double period;
+    FILE *f;
+    int n;
+
+    snprintf(path, sizeof(path), "%s/cpu.max", dir);
+    if ((f = fopen(path, "r")) == NULL)
+        return 0;
+    n = fscanf(f, "%31s %lf", max, &period);
+    fclose(f);
+    if (n != 2 || strcmp(max, "max") == 0 || period <= 0)
+        return 0;
+    return atof(max) / period;
+}
+
+
+// The same for cgroup v1, where a quota of -1 means none.
+static double quota_v1(const char *dir)
+{
+    char path[PATH_MAX + 32];
+    double quota = -1, period = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+    if ((f = fopen(path, "r")) != NULL) {
+        if (fscanf(f, "%lf", &quota) != 1)
+            quota = -1;
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+    if ((f = fopen(path, "r")) != NULL) {
+        if (fscanf(f, "%lf", &period) != 1)
+            period = 0;
+        fclose(f);
+    }
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return quota / period;
+}
+
+
+/*
+ * The lowest quota from the cgroup at path up to the root of the 
+ * hierarchy mounted at mount. Inside a container the path is often that of
+ * the host, with the container's own cgroup mounted at the root, so the 
+ * root is always tried.
+ */
+static double quota_up(const char *mount, char *path, int v2)
+{
+    char dir[PATH_MAX];
+    double quota, min = 0;
+    char *slash;
+
+    for (;;) {
+        snprintf(dir, sizeof(dir), "%s%s", mount, path);
+        quota = v2 ? quota_v2(dir) : quota_v1(dir);
+        if (quota > 0 && (min == 0 || quota < min))
+            min = quota;
+        if ((slash = strrchr(path, '/')) == NULL)
+            break;
+        *slash = '\0';
+    }
+    return min;
+}
+
+
+// Lines of /proc/self/cgroup are "ID:CONTROLLERS:PATH", v2 has none.
+static double cgroup_quota()
+{
+    char line[PATH_MAX + 64], *controllers, *path, *c;
+    double quota, min = 0;
+    FILE *f;
+
+    if ((f = fopen("/proc/self/cgroup", "r")) == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if ((controllers = strchr(line, ':')) == NULL || 
+                (path = strchr(++controllers, ':')) == NULL)
+            continue;
+        *path++ = '\0';
+        if (strcmp(path, "/") == 0)
+            *path = '\0';
+
+        if (*controllers == '\0')
+            quota = quota_up(CGROUP_ROOT, path, 1);
+        else {
+            quota = 0;
+            for (c = strtok(controllers, ","); c != NULL; 
+                    c = strtok(NULL, ","))
+                if (strcmp(c, "cpu") == 0)
+                    break;
+            if (c == NULL)
+                continue;
+            quota = quota_up(CGROUP_ROOT "/cpu", path, 0);
+            if (quota == 0)
+                quota = quota_up(CGROUP_ROOT "/cpu,cpuacct", path, 0);
+        }
+        if (quota > 0 && (min == 0 || quota < min))
+            min = quota;
+    }
+    fclose(f);
+    return min;
+}
+#endif
+
+
+int cpus_available()
+{
+    int count = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef __linux__
+    cpu_set_t set;
+    double quota;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        count = CPU_COUNT(&set);
+
+    // a quota of 2.5 CPUs keeps 3 threads busy, if not all the time
+    quota = cgroup_quota();
+    if (quota > 0 && quota < count)
+        count = ceil(quota);
+#endif
+    return count > 0 ? count : 1;
+}
+
+
+int cpus_list(int *cpu, int max)
+{
+    int count = 0;
+#ifdef __linux__
+    cpu_set_t set;
+    int i;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return 0;
+    for (i = 0; i < CPU_SETSIZE && count < max; i++)
+        if (CPU_ISSET(i, &set))
+            cpu[count++] = i;
+#endif
+    return count;
+}
+
+
+int cpus_pin(pthread_t thread, int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+    return -1;
+#endif
+}
@@ -17,20 +17,24 @@
  * along with this program. If not, see 
  * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
  */
-#ifndef __PTHREAD_SEM_H
-#define __PTHREAD_SEM_H
+#ifndef __CPUS_H
+#define __CPUS_H
 
 #include <pthread.h>
 
-struct pthread_sem {
-    int val;
-    pthread_cond_t cond;
-};
-typedef struct pthread_sem pthread_sem_t;
+// CPU ids listed at most
+#define CPUS_MAX 1024
 
+/*
+ * CPUs the process may actually use: those of its affinity mask, bounded 
+ * by the CPU quota of its cgroup, v1 or v2. At least 1.
+ */
+int cpus_available();
+
+// Fills cpu with the ids in the affinity mask, at most max; returns how many.
+int cpus_list(int *cpu, int max);
 
-int pthread_sem_down(int val, pthread_sem_t *sem, pthread_mutex_t *mutex);
-int pthread_sem_up(int val, pthread_sem_t *sem);
-int pthread_sem_init(int val, pthread_sem_t *sem);
+// Binds thread to cpu; returns non-zero where unsupported or on failure.
+int cpus_pin(pthread_t thread, int cpu);
 
 #endif
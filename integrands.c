@@ -20,6 +20,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_integration.h>
 
@@ -53,120 +54,347 @@ double integrand_n_n1(double *x, size_t dim, void *params)
 }
 
 
-inline double pdfx_n_n(double *x, int n, void *params)
+/*
+ * Exact integrals of integrand_n_n / integrand_n_n1 over x[0] in [a, b] 
+ * and over the full supports of x[1] and x[2]. D = x[2] - x[1] has a 
+ * triangular density centered at shift and the integral reduces to 
+ * E[|[a, b] & [-D, 2 PI - D]|] / (2 PI). The integrand of that expectation 
+ * is quadratic between the breakpoints below, so Simpson's rule on each 
+ * piece is exact.
+ */
+static double overlap(double d, double a, double b)
 {
-    protocol_params_t *p = (protocol_params_t *) params;
+    double lo = a > -d ? a : -d;
+    double hi = b < 2 * M_PI - d ? b : 2 * M_PI - d;
 
-    return pdf_uniform(x[0] - x[1] + x[2], 0, 2 * M_PI) *
-        pdf_uniform(x[1], 2 * n * M_PI, 2 * (n + 1) * M_PI - p->on) *
-        pdf_uniform(x[2], 2 * n * M_PI, 2 * (n + 1) * M_PI - p->on);
+    return hi > lo ? hi - lo : 0;
 }
 
 
-inline double pdfx_n_n1(double *x, int n, void *params)
+static double triangle(double d, double shift, double w)
 {
-    protocol_params_t *p = (protocol_params_t *) params;
+    double t = w - fabs(d - shift);
 
-    return pdf_uniform(x[0] - x[1] + x[2], 0, 2 * M_PI) *
-        pdf_uniform(x[1], 2 * (n - 1) * M_PI, 2 * n * M_PI - p->on) *
-        pdf_uniform(x[2], 2 * n * M_PI, 2 * (n + 1) * M_PI - p->on);
+    return t > 0 ? t / w / w : 0;
+}
+
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+static double integral_slot(double a, double b, double shift, 
+        protocol_params_t *p)
+{
+    double w = 2 * M_PI - p->on;
+    double lo = shift - w, hi = shift + w;
+    double points[] = {
+        lo, shift, hi,
+        -a, -b, 2 * M_PI - a, 2 * M_PI - b
+    };
+    int i, n = sizeof(points) / sizeof(points[0]);
+    double res = 0;
+
+    assert(w > 0);
+    qsort(points, n, sizeof(double), compare_double);
+
+    for (i = 1; i < n; i++) {
+        double x0 = points[i - 1], x1 = points[i], xm;
+
+        if (x0 < lo)
+            x0 = lo;
+        if (x1 > hi)
+            x1 = hi;
+        if (x1 <= x0)
+            continue;
+
+        xm = (x0 + x1) / 2;
+        res += (x1 - x0) / 6 * (overlap(x0, a, b) * triangle(x0, shift, w) +
+                4 * overlap(xm, a, b) * triangle(xm, shift, w) + 
+                overlap(x1, a, b) * triangle(x1, shift, w));
+    }
+    return res / 2 / M_PI;
+}
+
+
+double integral_n_n(double a, double b, protocol_params_t *p)
+{
+    return integral_slot(a, b, 0, p);
+}
+
+
+double integral_n_n1(double a, double b, protocol_params_t *p)
+{
+    return integral_slot(a, b, 2 * M_PI, p);
+}
+
+
+void chain_params_init(chain_params_t *cp, int n, int k, 
+        protocol_params_t *p)
+{
+    double w = 2 * M_PI - p->on;
+    int j;
+
+    cp->n = n;
+    cp->k = k;
+    cp->protocol = p;
+    for (j = 0; j < CHAIN_LEVELS; j++) {
+        cp->lo[j] = 2 * (n - j) * M_PI;
+        cp->hi[j] = 2 * (n - j + 1) * M_PI - p->on;
+    }
+    cp->scale = pow(1. / (2 * M_PI * w * w), k * (k + 1) / 2);
+}
+
+
+/*
+ * Scalar chain integrands, one unrolled kernel per order and chain type.
+ * Every pdfx factor is an indicator times a constant folded into 
+ * cp->scale. The stages are tested from the last one down, closing factor
+ * first, as the long sums are the least likely to fall in [0, 2 PI]; the 
+ * first failing test ends the evaluation.
+ */
+#define LEVEL(v, j) ((v) >= lo[j] && (v) <= hi[j])
+
+// b and c both in period n - j, s being the argument of the factor
+#define NN(s, b, c, j) \
+    if (!((s) >= 0 && (s) <= 2 * M_PI && LEVEL(x[b], j) && LEVEL(x[c], j))) \
+        return 0;
+
+// c in period n - j and b in the period before it
+#define N1(s, b, c, j) \
+    if (!((s) >= 0 && (s) <= 2 * M_PI && LEVEL(x[b], j + 1) && \
+                LEVEL(x[c], j))) \
+        return 0;
+
+#define BN_STAGE1 \
+    NN(x[0] - x[1] + x[2], 1, 2, 0)
+#define BN_STAGE2 \
+    NN(x[0] - x[6] + x[3] - x[7] + x[8], 7, 8, 0) \
+    N1(x[3] - x[4] + x[5], 4, 5, 0)
+#define BN_STAGE3 \
+    NN(x[0] - x[6] + x[15] + x[12] - x[9] - x[16] + x[17], 16, 17, 0) \
+    NN(x[9] - x[10] + x[11], 10, 11, 1) \
+    N1(x[12] - x[13] + x[14], 13, 14, 0)
+#define BN_STAGE4 \
+    NN(x[0] - x[6] + x[15] - x[27] + x[24] - x[21] + x[18] - x[28] + x[29],\
+            28, 29, 0) \
+    N1(x[18] - x[19] + x[20], 19, 20, 1) \
+    NN(x[21] - x[22] + x[23], 22, 23, 1) \
+    N1(x[24] - x[25] + x[26], 25, 26, 0)
+#define BN_STAGE5 \
+    NN(x[0] - x[6] + x[15] - x[27] + x[42] + x[39] - x[36] + x[33] - x[30] -\
+            x[43] + x[44], 43, 44, 0) \
+    NN(x[30] - x[31] + x[32], 31, 32, 2) \
+    N1(x[33] - x[34] + x[35], 34, 35, 1) \
+    NN(x[36] - x[37] + x[38], 37, 38, 1) \
+    N1(x[39] - x[40] + x[41], 40, 41, 0)
+
+#define AN_STAGE1 \
+    N1(x[0] - x[1] + x[2], 1, 2, 0)
+#define AN_STAGE2 \
+    N1(x[0] - x[6] + x[3] - x[7] + x[8], 7, 8, 0) \
+    NN(x[3] - x[4] + x[5], 4, 5, 1)
+#define AN_STAGE3 \
+    N1(x[0] - x[6] + x[15] + x[12] - x[9] - x[16] + x[17], 16, 17, 0) \
+    N1(x[9] - x[10] + x[11], 10, 11, 1) \
+    NN(x[12] - x[13] + x[14], 13, 14, 1)
+#define AN_STAGE4 \
+    N1(x[0] - x[6] + x[15] - x[27] + x[24] - x[21] + x[18] - x[28] + x[29],\
+            28, 29, 0) \
+    NN(x[18] - x[19] + x[20], 19, 20, 2) \
+    N1(x[21] - x[22] + x[23], 22, 23, 1) \
+    NN(x[24] - x[25] + x[26], 25, 26, 1)
+#define AN_STAGE5 \
+    N1(x[0] - x[6] + x[15] - x[27] + x[42] + x[39] - x[36] + x[33] - x[30] -\
+            x[43] + x[44], 43, 44, 0) \
+    N1(x[30] - x[31] + x[32], 31, 32, 2) \
+    NN(x[33] - x[34] + x[35], 34, 35, 2) \
+    N1(x[36] - x[37] + x[38], 37, 38, 1) \
+    NN(x[39] - x[40] + x[41], 40, 41, 1)
+
+#define CHAIN_KERNEL(name, stages) \
+static double name(double *x, size_t dim, void *params) \
+{ \
+    chain_params_t *cp = (chain_params_t *) params; \
+    const double *lo = cp->lo, *hi = cp->hi; \
+    \
+    stages \
+    return cp->scale; \
+}
+
+CHAIN_KERNEL(chain_bn1, BN_STAGE1)
+CHAIN_KERNEL(chain_bn2, BN_STAGE2 BN_STAGE1)
+CHAIN_KERNEL(chain_bn3, BN_STAGE3 BN_STAGE2 BN_STAGE1)
+CHAIN_KERNEL(chain_bn4, BN_STAGE4 BN_STAGE3 BN_STAGE2 BN_STAGE1)
+CHAIN_KERNEL(chain_bn5, BN_STAGE5 BN_STAGE4 BN_STAGE3 BN_STAGE2 BN_STAGE1)
+
+CHAIN_KERNEL(chain_an1, AN_STAGE1)
+CHAIN_KERNEL(chain_an2, AN_STAGE2 AN_STAGE1)
+CHAIN_KERNEL(chain_an3, AN_STAGE3 AN_STAGE2 AN_STAGE1)
+CHAIN_KERNEL(chain_an4, AN_STAGE4 AN_STAGE3 AN_STAGE2 AN_STAGE1)
+CHAIN_KERNEL(chain_an5, AN_STAGE5 AN_STAGE4 AN_STAGE3 AN_STAGE2 AN_STAGE1)
+
+static const integrand_t chain_bn[] = {
+    chain_bn1, chain_bn2, chain_bn3, chain_bn4, chain_bn5
+};
+
+static const integrand_t chain_an[] = {
+    chain_an1, chain_an2, chain_an3, chain_an4, chain_an5
+};
+
+#undef LEVEL
+#undef NN
+#undef N1
+#undef CHAIN_KERNEL
+
+
+integrand_t integrand_chain(int an, int k)
+{
+    assert(k > 0 && k <= 5);
+    return an ? chain_an[k - 1] : chain_bn[k - 1];
 }
 
 
 double integrand_chain_bn(double *x, size_t dim, void *params)
 {
-    chain_params_t *cp = (chain_params_t *) params;
-    protocol_params_t *p = cp->protocol;
-    double res, xt[3];
-
-    res = pdfx_n_n(x, cp->n, p);
-    if (cp->k == 1)
-        return res;
-
-    res *= pdfx_n_n1(x + 3, cp->n, p);
-    xt[0] = x[0] - x[6] + x[3];
-    xt[1] = x[7];
-    xt[2] = x[8];
-    res *= pdfx_n_n(xt, cp->n, p);
-    if (cp->k == 2)
-        return res;
-
-    res *= pdfx_n_n(x + 9, cp->n - 1, p);
-    res *= pdfx_n_n1(x + 12, cp->n, p);
-    xt[0] = x[0] - x[6] + x[15] + x[12] - x[9];
-    xt[1] = x[16];
-    xt[2] = x[17];
-    res *= pdfx_n_n(xt, cp->n, p);
-    if (cp->k == 3)
-        return res;
-
-    res *= pdfx_n_n1(x + 18, cp->n - 1, p);
-    res *= pdfx_n_n(x + 21, cp->n - 1, p);
-    res *= pdfx_n_n1(x + 24, cp->n, p);
-    xt[0] = x[0] - x[6] + x[15] - x[27] + x[24] - x[21] + x[18];
-    xt[1] = x[28];
-    xt[2] = x[29];
-    res *= pdfx_n_n(xt, cp->n, p);
-    if (cp->k == 4)
-        return res;
-
-    res *= pdfx_n_n(x + 30, cp->n - 2, p);
-    res *= pdfx_n_n1(x + 33, cp->n - 1, p);
-    res *= pdfx_n_n(x + 36, cp->n - 1, p);
-    res *= pdfx_n_n1(x + 39, cp->n, p);
-    xt[0] = x[0] - x[6] + x[15] - x[27] + x[42] + x[39] - x[36] + x[33] - x[30];
-    xt[1] = x[43];
-    xt[2] = x[44];
-    res *= pdfx_n_n(xt, cp->n, p);
-    return res;
+    return chain_bn[((chain_params_t *) params)->k - 1](x, dim, params);
 }
 
 
 double integrand_chain_an(double *x, size_t dim, void *params)
+{
+    return chain_an[((chain_params_t *) params)->k - 1](x, dim, params);
+}
+
+
+
+/*
+ * Batched, branch-free versions of the chain integrands. Point i has its 
+ * coordinate d at x[d * stride + i]. Every pdfx factor is an indicator 
+ * times 1 / (2 PI (2 PI - on)^2), so only indicators are multiplied inside 
+ * the loops and cp->scale is applied once. Each stage is a separate 
+ * loop over the block so that it vectorizes.
+ */
+#define X(d) x[(d) * stride + i]
+
+
+static inline double in_range(double v, double lo, double hi)
+{
+    return (double) ((v >= lo) & (v <= hi));
+}
+
+
+// indicator of b and c both in period n - j
+static inline double nn(double s, double b, double c, const double *lo, 
+        const double *hi, int j)
+{
+    return in_range(s, 0, 2 * M_PI) * in_range(b, lo[j], hi[j]) * 
+        in_range(c, lo[j], hi[j]);
+}
+
+
+// indicator of c in period n - j and b in the period before it
+static inline double n1(double s, double b, double c, const double *lo, 
+        const double *hi, int j)
+{
+    return in_range(s, 0, 2 * M_PI) * in_range(b, lo[j + 1], hi[j + 1]) * 
+        in_range(c, lo[j], hi[j]);
+}
+
+
+SIMD_CLONES
+void integrand_chain_bn_batch(const double *x, size_t stride, size_t count,
+        void *params, double *out)
 {
     chain_params_t *cp = (chain_params_t *) params;
-    protocol_params_t *p = cp->protocol;
-    double res, xt[3];
-
-    res = pdfx_n_n1(x, cp->n, p);
-    if (cp->k == 1) 
-        return res;
-    
-    res *= pdfx_n_n(x + 3, cp->n - 1, p);
-    xt[0] = x[0] - x[6] + x[3];
-    xt[1] = x[7];
-    xt[2] = x[8];
-    res *= pdfx_n_n1(xt, cp->n, p);
-    if (cp->k == 2)
-        return res;
-
-    res *= pdfx_n_n1(x + 9, cp->n - 1, p);
-    res *= pdfx_n_n(x + 12, cp->n - 1, p);
-    xt[0] = x[0] - x[6] + x[15] + x[12] - x[9];
-    xt[1] = x[16];
-    xt[2] = x[17];
-    res *= pdfx_n_n1(xt, cp->n, p);
-    if (cp->k == 3)
-        return res;
-
-    res *= pdfx_n_n(x + 18, cp->n - 2, p);
-    res *= pdfx_n_n1(x + 21, cp->n - 1, p);
-    res *= pdfx_n_n(x + 24, cp->n - 1, p);
-    xt[0] = x[0] - x[6] + x[15] - x[27] + x[24] - x[21] + x[18];
-    xt[1] = x[28];
-    xt[2] = x[29];
-    res *= pdfx_n_n1(xt, cp->n, p);
-    if (cp->k == 4)
-        return res;
-
-    res *= pdfx_n_n1(x + 30, cp->n - 2, p);
-    res *= pdfx_n_n(x + 33, cp->n - 2, p);
-    res *= pdfx_n_n1(x + 36, cp->n - 1, p);
-    res *= pdfx_n_n(x + 39, cp->n - 1, p);
-    xt[0] = x[0] - x[6] + x[15] - x[27] + x[42] + x[39] - x[36] + x[33] - x[30];
-    xt[1] = x[43];
-    xt[2] = x[44];
-    res *= pdfx_n_n1(xt, cp->n, p);
-    return res;
+    const double *lo = cp->lo, *hi = cp->hi;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        out[i] = nn(X(0) - X(1) + X(2), X(1), X(2), lo, hi, 0);
+
+    if (cp->k > 1)
+        for (i = 0; i < count; i++)
+            out[i] *= n1(X(3) - X(4) + X(5), X(4), X(5), lo, hi, 0) *
+                nn(X(0) - X(6) + X(3) - X(7) + X(8), X(7), X(8), lo, hi, 0);
+
+    if (cp->k > 2)
+        for (i = 0; i < count; i++)
+            out[i] *= nn(X(9) - X(10) + X(11), X(10), X(11), lo, hi, 1) *
+                n1(X(12) - X(13) + X(14), X(13), X(14), lo, hi, 0) *
+                nn(X(0) - X(6) + X(15) + X(12) - X(9) - X(16) + X(17), 
+                        X(16), X(17), lo, hi, 0);
+
+    if (cp->k > 3)
+        for (i = 0; i < count; i++)
+            out[i] *= n1(X(18) - X(19) + X(20), X(19), X(20), lo, hi, 1) *
+                nn(X(21) - X(22) + X(23), X(22), X(23), lo, hi, 1) *
+                n1(X(24) - X(25) + X(26), X(25), X(26), lo, hi, 0) *
+                nn(X(0) - X(6) + X(15) - X(27) + X(24) - X(21) + X(18) - 
+                        X(28) + X(29), X(28), X(29), lo, hi, 0);
+
+    if (cp->k > 4)
+        for (i = 0; i < count; i++)
+            out[i] *= nn(X(30) - X(31) + X(32), X(31), X(32), lo, hi, 2) *
+                n1(X(33) - X(34) + X(35), X(34), X(35), lo, hi, 1) *
+                nn(X(36) - X(37) + X(38), X(37), X(38), lo, hi, 1) *
+                n1(X(39) - X(40) + X(41), X(40), X(41), lo, hi, 0) *
+                nn(X(0) - X(6) + X(15) - X(27) + X(42) + X(39) - X(36) + 
+                        X(33) - X(30) - X(43) + X(44), X(43), X(44), 
+                        lo, hi, 0);
+
+    for (i = 0; i < count; i++)
+        out[i] *= cp->scale;
+}
+
+
+SIMD_CLONES
+void integrand_chain_an_batch(const double *x, size_t stride, size_t count,
+        void *params, double *out)
+{
+    chain_params_t *cp = (chain_params_t *) params;
+    const double *lo = cp->lo, *hi = cp->hi;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        out[i] = n1(X(0) - X(1) + X(2), X(1), X(2), lo, hi, 0);
+
+    if (cp->k > 1)
+        for (i = 0; i < count; i++)
+            out[i] *= nn(X(3) - X(4) + X(5), X(4), X(5), lo, hi, 1) *
+                n1(X(0) - X(6) + X(3) - X(7) + X(8), X(7), X(8), lo, hi, 0);
+
+    if (cp->k > 2)
+        for (i = 0; i < count; i++)
+            out[i] *= n1(X(9) - X(10) + X(11), X(10), X(11), lo, hi, 1) *
+                nn(X(12) - X(13) + X(14), X(13), X(14), lo, hi, 1) *
+                n1(X(0) - X(6) + X(15) + X(12) - X(9) - X(16) + X(17), 
+                        X(16), X(17), lo, hi, 0);
+
+    if (cp->k > 3)
+        for (i = 0; i < count; i++)
+            out[i] *= nn(X(18) - X(19) + X(20), X(19), X(20), lo, hi, 2) *
+                n1(X(21) - X(22) + X(23), X(22), X(23), lo, hi, 1) *
+                nn(X(24) - X(25) + X(26), X(25), X(26), lo, hi, 1) *
+                n1(X(0) - X(6) + X(15) - X(27) + X(24) - X(21) + X(18) - 
+                        X(28) + X(29), X(28), X(29), lo, hi, 0);
+
+    if (cp->k > 4)
+        for (i = 0; i < count; i++)
+            out[i] *= n1(X(30) - X(31) + X(32), X(31), X(32), lo, hi, 2) *
+                nn(X(33) - X(34) + X(35), X(34), X(35), lo, hi, 2) *
+                n1(X(36) - X(37) + X(38), X(37), X(38), lo, hi, 1) *
+                nn(X(39) - X(40) + X(41), X(40), X(41), lo, hi, 1) *
+                n1(X(0) - X(6) + X(15) - X(27) + X(42) + X(39) - X(36) + 
+                        X(33) - X(30) - X(43) + X(44), X(43), X(44), 
+                        lo, hi, 0);
+
+    for (i = 0; i < count; i++)
+        out[i] *= cp->scale;
 }
 
+#undef X
@@ -21,16 +21,48 @@
 #define __INTEGRANDS_H
 #include "wildmac.h"
 
+/*
+ * Marks vectorized kernels: on x86-64 Linux they are compiled for several 
+ * instruction sets and the best one is picked at load time from CPUID.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define SIMD_CLONES \
+    __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+#define CHAIN_LEVELS 4
+
+/*
+ * lo[j] and hi[j] bound the slot offsets at level n - j and scale is the 
+ * product of the pdf constants, all set by chain_params_init.
+ */
 struct chain_params {
     int n;
     int k;
     protocol_params_t *protocol;
+    double lo[CHAIN_LEVELS], hi[CHAIN_LEVELS];
+    double scale;
 };
 typedef struct chain_params chain_params_t;
 
+typedef double (*integrand_t)(double *x, size_t dim, void *params);
+
 double integrand_n_n(double *x, size_t dim, void *params);
 double integrand_n_n1(double *x, size_t dim, void *params);
+double integral_n_n(double a, double b, protocol_params_t *p);
+double integral_n_n1(double a, double b, protocol_params_t *p);
+void chain_params_init(chain_params_t *cp, int n, int k, 
+        protocol_params_t *p);
+// the kernel of order k, without dispatching on cp->k per call
+integrand_t integrand_chain(int an, int k);
 double integrand_chain_bn(double *x, size_t dim, void *params);
 double integrand_chain_an(double *x, size_t dim, void *params);
 
+void integrand_chain_bn_batch(const double *x, size_t stride, size_t count,
+        void *params, double *out);
+void integrand_chain_an_batch(const double *x, size_t stride, size_t count,
+        void *params, double *out);
+
 #endif
@@ -0,0 +1,621 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <gsl/gsl_math.h>
+#include <gsl/gsl_monte.h>
+#include <gsl/gsl_monte_plain.h>
+#include <gsl/gsl_monte_vegas.h>
+#include <gsl/gsl_monte_miser.h>
+#include <gsl/gsl_qrng.h>
+#include <gsl/gsl_rng.h>
+#include <pthread.h>
+
+#include "integration.h"
+#include "context.h"
+
+#define PLAIN_CALLS 500000
+#define QMC_CALLS 32768
+#define QMC_SHIFTS 16
+#define ADAPTIVE_TOL 1e-3
+#define ADAPTIVE_ROUNDS 50
+#define BLOCK 256
+// error estimates from fewer non-zero samples are not trusted
+#define MIN_HITS 16
+
+
+static const struct {
+    const char *name;
+    const gsl_qrng_type **type;
+} qrng_types[] = {
+    { "sobol", &gsl_qrng_sobol },
+    { "niederreiter", &gsl_qrng_niederreiter_2 },
+    { "halton", &gsl_qrng_halton },
+    { "reversehalton", &gsl_qrng_reversehalton }
+};
+
+
+void integration_defaults(integration_settings_t *s)
+{
+    s->backend = BACKEND_PLAIN;
+    s->qrng = NULL;
+    s->calls = PLAIN_CALLS;
+    s->tol_rel = ADAPTIVE_TOL;
+    s->shifts = QMC_SHIFTS;
+    s->seed = 0;
+    s->exact_slots = 1;
+    s->conditional = 1;
+    s->accuracy = 0;
+}
+
+
+int integration_select(integration_settings_t *s, const char *name)
+{
+    int i;
+
+    if (strcmp(name, "plain") == 0) {
+        s->backend = BACKEND_PLAIN;
+        s->qrng = NULL;
+        s->calls = PLAIN_CALLS;
+        return 0;
+    }
+
+    if (strcmp(name, "vegas") == 0 || strcmp(name, "miser") == 0) {
+        s->backend = name[0] == 'v' ? BACKEND_VEGAS : BACKEND_MISER;
+        s->qrng = NULL;
+        s->calls = PLAIN_CALLS;
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(qrng_types) / sizeof(qrng_types[0]); i++) {
+        if (strcmp(name, qrng_types[i].name) != 0)
+            continue;
+        s->backend = BACKEND_QMC;
+        s->qrng = *qrng_types[i].type;
+        s->calls = QMC_CALLS;
+        return 0;
+    }
+    return -1;
+}
+
+
+const char *integration_name(const integration_settings_t *s)
+{
+    switch (s->backend) {
+        case BACKEND_QMC:
+            return s->qrng->name;
+        case BACKEND_VEGAS:
+            return "vegas";
+        case BACKEND_MISER:
+            return "miser";
+    }
+    return "plain";
+}
+
+
+int integration_shares_samples(const integration_settings_t *s)
+{
+    return s->backend == BACKEND_PLAIN || s->backend == BACKEND_QMC;
+}
+
+
+static double integrate_plain(const integration_settings_t *set, 
+        gsl_monte_function *F, double *xl, double *xu, double *err)
+{
+    double res;
+    gsl_monte_plain_state *s;
+    gsl_rng *r;
+
+    r = gsl_rng_alloc(gsl_rng_default);
+    gsl_rng_set(r, set->seed);
+    s = gsl_monte_plain_alloc(F->dim);
+    gsl_monte_plain_integrate(F, xl, xu, F->dim, set->calls, r, s, 
+            &res, err);
+    gsl_monte_plain_free(s);
+    gsl_rng_free(r);
+
+    return res;
+}
+
+
+/*
+ * xoshiro256** feeds the in-house sampling loop: it is inlined, unlike 
+ * gsl_rng_uniform, which costs an indirect call per coordinate.
+ */
+struct xoshiro {
+    uint64_t s[4];
+};
+
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+
+static void xoshiro_seed(struct xoshiro *r, unsigned long seed)
+{
+    uint64_t z = seed;
+    int i;
+
+    // splitmix64
+    for (i = 0; i < 4; i++) {
+        z += 0x9e3779b97f4a7c15ULL;
+        r->s[i] = z;
+        r->s[i] = (r->s[i] ^ (r->s[i] >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        r->s[i] = (r->s[i] ^ (r->s[i] >> 27)) * 0x94d049bb133111ebULL;
+        r->s[i] ^= r->s[i] >> 31;
+    }
+}
+
+
+static inline double xoshiro_uniform(struct xoshiro *r)
+{
+    uint64_t *s = r->s;
+    uint64_t res = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return (res >> 11) * (1. / 9007199254740992.);
+}
+
+
+static int converged(double err, double tol, size_t hits)
+{
+    return tol > 0 && hits >= MIN_HITS && err <= tol;
+}
+
+
+static void integrate_plain_batch(const integration_settings_t *set, 
+        size_t dim, size_t outputs, size_t target, batch_function_t batch, 
+        void *params, double *xl, double *xu, double tol, double *res, 
+        double *err)
+{
+    size_t chunk = set->calls / ADAPTIVE_ROUNDS;
+    size_t done, count, i, d, m, hits = 0;
+    double *x, *out, *sum, *sum2;
+    double vol = 1, mean, var;
+    struct xoshiro r;
+
+    xoshiro_seed(&r, set->seed);
+    x = malloc(dim * BLOCK * sizeof(double));
+    out = malloc(outputs * BLOCK * sizeof(double));
+    sum = calloc(outputs, sizeof(double));
+    sum2 = calloc(outputs, sizeof(double));
+    for (d = 0; d < dim; d++)
+        vol *= xu[d] - xl[d];
+    if (chunk < BLOCK)
+        chunk = BLOCK;
+
+    for (done = 0; done < set->calls; done += count) {
+        count = set->calls - done;
+        if (count > BLOCK)
+            count = BLOCK;
+
+        for (d = 0; d < dim; d++)
+            for (i = 0; i < count; i++)
+                x[d * BLOCK + i] = xl[d] + 
+                    xoshiro_uniform(&r) * (xu[d] - xl[d]);
+
+        batch(x, BLOCK, count, params, out);
+        for (m = 0; m < outputs; m++)
+            for (i = 0; i < count; i++) {
+                sum[m] += out[m * BLOCK + i];
+                sum2[m] += out[m * BLOCK + i] * out[m * BLOCK + i];
+            }
+        for (i = 0; i < count; i++)
+            hits += out[target * BLOCK + i] != 0;
+
+        if (tol > 0 && (done + count) % chunk < count) {
+            mean = sum[target] / (done + count);
+            var = (sum2[target] - sum[target] * mean) / (done + count - 1);
+            err[target] = vol * sqrt((var > 0 ? var : 0) / (done + count));
+            if (converged(err[target], tol, hits)) {
+                done += count;
+                break;
+            }
+        }
+    }
+
+    for (m = 0; m < outputs; m++) {
+        mean = sum[m] / done;
+        var = done > 1 ? (sum2[m] - sum[m] * mean) / (done - 1) : 0;
+        err[m] = vol * sqrt((var > 0 ? var : 0) / done);
+        res[m] = vol * mean;
+    }
+    free(x);
+    free(out);
+    free(sum);
+    free(sum2);
+}
+
+
+struct scalar_batch {
+    gsl_monte_function *F;
+    double *point;
+};
+
+
+// Lets the in-house loops drive integrands that have no batch version.
+static void scalar_batch(const double *x, size_t stride, size_t count, 
+        void *params, double *out)
+{
+    struct scalar_batch *sb = (struct scalar_batch *) params;
+    size_t i, d;
+
+    for (i = 0; i < count; i++) {
+        for (d = 0; d < sb->F->dim; d++)
+            sb->point[d] = x[d * stride + i];
+        out[i] = sb->F->f(sb->point, sb->F->dim, sb->F->params);
+    }
+}
+
+
+/*
+ * Randomized QMC: the same low-discrepancy point set is evaluated under 
+ * several random shifts (modulo 1). Each shift yields an independent, 
+ * unbiased estimate; their spread gives the error estimate.
+ */
+static double qmc_estimate(double *sums, int shifts, size_t points, 
+        double vol, double *err)
+{
+    double mean = 0, var = 0;
+    int j;
+
+    for (j = 0; j < shifts; j++)
+        mean += sums[j];
+    mean *= vol / points / shifts;
+    for (j = 0; j < shifts; j++) {
+        double e = sums[j] * vol / points;
+        var += (e - mean) * (e - mean);
+    }
+    *err = sqrt(var / shifts / (shifts - 1));
+    return mean;
+}
+
+
+// Without batch, F is called per point and there is a single output.
+static void integrate_qmc(const integration_settings_t *set, 
+        gsl_monte_function *F, size_t outputs, size_t target, 
+        batch_function_t batch, void *params, double *xl, double *xu, 
+        double tol, double *res, double *err)
+{
+    const gsl_qrng_type *T = set->qrng;
+    size_t dim = F->dim;
+    size_t points, i, d, m;
+    int shifts = set->shifts;
+    int j;
+    size_t block, filled = 0, hits = 0;
+    double *u, *x, *shift, *sums, *out;
+    double vol = 1;
+    gsl_qrng *q;
+    gsl_rng *r;
+
+    assert(shifts > 1);
+    assert(batch != NULL || outputs == 1);
+    points = set->calls / shifts;
+    if (points < 1)
+        points = 1;
+
+    // Sobol and Niederreiter are tabulated for low dimensions only.
+    if (dim > T->max_dimension)
+        T = gsl_qrng_halton;
+
+    // a block holds whole groups of shifted copies of the same point
+    block = batch != NULL ? (BLOCK / shifts + 1) * shifts : shifts;
+    u = malloc(dim * sizeof(double));
+    x = malloc(dim * block * sizeof(double));
+    out = malloc(outputs * block * sizeof(double));
+    shift = malloc(shifts * dim * sizeof(double));
+    sums = calloc(outputs * shifts, sizeof(double));
+
+    r = gsl_rng_alloc(gsl_rng_default);
+    gsl_rng_set(r, set->seed);
+    for (i = 0; i < shifts * dim; i++)
+        shift[i] = gsl_rng_uniform(r);
+    gsl_rng_free(r);
+
+    for (d = 0; d < dim; d++)
+        vol *= xu[d] - xl[d];
+
+    q = gsl_qrng_alloc(T, dim);
+    for (i = 0; i < points; i++) {
+        gsl_qrng_get(q, u);
+        for (j = 0; j < shifts; j++, filled++) {
+            for (d = 0; d < dim; d++) {
+                double y = u[d] + shift[j * dim + d];
+                if (y >= 1)
+                    y -= 1;
+                x[d * block + filled] = xl[d] + y * (xu[d] - xl[d]);
+            }
+        }
+        if (filled + shifts <= block && i + 1 < points)
+            continue;
+
+        if (batch != NULL)
+            batch(x, block, filled, params, out);
+        else 
+            for (j = 0; j < filled; j++) {
+                for (d = 0; d < dim; d++)
+                    u[d] = x[d * block + j];
+                out[j] = F->f(u, dim, F->params);
+            }
+        for (m = 0; m < outputs; m++)
+            for (j = 0; j < filled; j++)
+                sums[m * shifts + j % shifts] += out[m * block + j];
+        for (j = 0; j < filled; j++)
+            hits += out[target * block + j] != 0;
+        filled = 0;
+
+        if (tol > 0) {
+            qmc_estimate(sums + target * shifts, shifts, i + 1, vol, 
+                    &err[target]);
+            if (converged(err[target], tol, hits)) {
+                i++;
+                break;
+            }
+        }
+    }
+    gsl_qrng_free(q);
+
+    for (m = 0; m < outputs; m++)
+        res[m] = qmc_estimate(sums + m * shifts, shifts, i, vol, &err[m]);
+
+    free(u);
+    free(x);
+    free(out);
+    free(shift);
+    free(sums);
+}
+
+
+// the inverse-variance weighted mean of the rounds so far
+struct adaptive_mean {
+    double sum, wsum;
+    double floor; // error of the last round with one, 0 before
+    int zeros; // rounds without an error, not yet weighted
+    double zero_sum;
+};
+
+
+static void adaptive_add(struct adaptive_mean *a, double res, double err)
+{
+    a->sum += res / err / err;
+    a->wsum += 1 / err / err;
+}
+
+
+/*
+ * Folds one independent estimate into the weighted mean. A round with all
+ * samples equal, typically outside the support, has no error of its own: 
+ * it weighs as much as the last round that had one. Until such a round 
+ * comes the mean is that of the zero-error rounds, and is only taken as 
+ * exact if the budget runs out first. Returns non-zero once the combined 
+ * error reaches tol or, without one, the relative tolerance.
+ */
+static int adaptive_round(const integration_settings_t *set, 
+        struct adaptive_mean *a, double res, double err, double tol, 
+        double *mean, double *mean_err)
+{
+    if (err == 0 && a->floor == 0) {
+        a->zeros++;
+        a->zero_sum += res;
+        *mean = a->zero_sum / a->zeros;
+        *mean_err = 0;
+        return 0;
+    }
+
+    if (err > 0) {
+        a->floor = err;
+        for (; a->zeros > 0; a->zeros--)
+            adaptive_add(a, a->zero_sum / a->zeros, err);
+        a->zero_sum = 0;
+    }
+    adaptive_add(a, res, err > 0 ? err : a->floor);
+
+    *mean = a->sum / a->wsum;
+    *mean_err = 1 / sqrt(a->wsum);
+    if (tol > 0)
+        return *mean_err <= tol;
+    return *mean_err <= set->tol_rel * fabs(*mean);
+}
+
+
+/*
+ * VEGAS is run one iteration at a time on a grid that keeps adapting. 
+ * The first round only trains the grid; later rounds are combined until 
+ * the tolerance or the call budget is reached.
+ */
+static double integrate_vegas(const integration_settings_t *set, 
+        gsl_monte_function *F, double *xl, double *xu, double tol, double *err)
+{
+    size_t chunk = set->calls / ADAPTIVE_ROUNDS;
+    size_t used;
+    double res, round_err, mean = 0;
+    struct adaptive_mean am = { 0 };
+    gsl_monte_vegas_state *s;
+    gsl_monte_vegas_params params;
+    gsl_rng *r;
+
+    if (chunk < 1)
+        chunk = 1;
+
+    r = gsl_rng_alloc(gsl_rng_default);
+    gsl_rng_set(r, set->seed);
+    s = gsl_monte_vegas_alloc(F->dim);
+    gsl_monte_vegas_params_get(s, &params);
+    params.iterations = 1;
+    gsl_monte_vegas_params_set(s, &params);
+
+    gsl_monte_vegas_integrate(F, xl, xu, F->dim, chunk, r, s, &res, err);
+    mean = res;
+    for (used = chunk; used + chunk <= set->calls; used += chunk) {
+        gsl_monte_vegas_integrate(F, xl, xu, F->dim, chunk, r, s, &res, 
+                &round_err);
+        if (adaptive_round(set, &am, res, round_err, tol, &mean, err))
+            break;
+    }
+
+    gsl_monte_vegas_free(s);
+    gsl_rng_free(r);
+    return mean;
+}
+
+
+/*
+ * MISER cannot resume a previous run, so rounds of doubling size are 
+ * combined instead.
+ */
+static double integrate_miser(const integration_settings_t *set, 
+        gsl_monte_function *F, double *xl, double *xu, double tol, double *err)
+{
+    size_t chunk = set->calls / ADAPTIVE_ROUNDS;
+    size_t used = 0;
+    double res, round_err, mean = 0;
+    struct adaptive_mean am = { 0 };
+    gsl_monte_miser_state *s;
+    gsl_rng *r;
+
+    if (chunk < 1)
+        chunk = 1;
+
+    r = gsl_rng_alloc(gsl_rng_default);
+    gsl_rng_set(r, set->seed);
+    s = gsl_monte_miser_alloc(F->dim);
+
+    while (used + chunk <= set->calls) {
+        gsl_monte_miser_integrate(F, xl, xu, F->dim, chunk, r, s, &res, 
+                &round_err);
+        used += chunk;
+        if (adaptive_round(set, &am, res, round_err, tol, &mean, err))
+            break;
+        if (used + 2 * chunk <= set->calls)
+            chunk *= 2;
+        else
+            chunk = set->calls - used;
+        if (chunk == 0)
+            break;
+    }
+
+    gsl_monte_miser_free(s);
+    gsl_rng_free(r);
+    return mean;
+}
+
+
+static void record_stats(size_t integrals, double *err)
+{
+    integration_stats_t *stats = &context()->stats;
+    size_t m;
+
+    pthread_mutex_lock(&stats->mutex);
+    stats->count += integrals;
+    for (m = 0; m < integrals; m++)
+        if (err[m] > stats->max_err)
+            stats->max_err = err[m];
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+
+/*
+ * The plain and QMC backends use batch, when given, instead of calling 
+ * F once per point. The adaptive backends always go through F.
+ */
+double integrate_batch(gsl_monte_function *F, batch_function_t batch, 
+        double *xl, double *xu, double tol, double *err)
+{
+    const integration_settings_t *set = &context()->integration;
+    double res;
+    struct scalar_batch sb = {
+        .F = F
+    };
+
+    switch (set->backend) {
+        case BACKEND_QMC:
+            integrate_qmc(set, F, 1, 0, batch, F->params, xl, xu, tol, &res, 
+                    err);
+            break;
+        case BACKEND_VEGAS:
+            res = integrate_vegas(set, F, xl, xu, tol, err);
+            break;
+        case BACKEND_MISER:
+            res = integrate_miser(set, F, xl, xu, tol, err);
+            break;
+        default:
+            if (batch != NULL)
+                integrate_plain_batch(set, F->dim, 1, 0, batch, F->params, 
+                        xl, xu, tol, &res, err);
+            else if (tol > 0) {
+                sb.point = malloc(F->dim * sizeof(double));
+                integrate_plain_batch(set, F->dim, 1, 0, &scalar_batch, &sb, 
+                        xl, xu, tol, &res, err);
+                free(sb.point);
+            } else
+                res = integrate_plain(set, F, xl, xu, err);
+    }
+
+    record_stats(1, err);
+    return res;
+}
+
+
+int integrate_multi(size_t dim, size_t outputs, size_t target, 
+        batch_function_t batch, void *params, double *xl, double *xu, 
+        double tol, double *res, double *err)
+{
+    gsl_monte_function F = {
+        .f = NULL,
+        .dim = dim,
+        .params = params
+    };
+    const integration_settings_t *set = &context()->integration;
+
+    switch (set->backend) {
+        case BACKEND_QMC:
+            integrate_qmc(set, &F, outputs, target, batch, params, xl, xu, 
+                    tol, res, err);
+            break;
+        case BACKEND_PLAIN:
+            integrate_plain_batch(set, dim, outputs, target, batch, params, 
+                    xl, xu, tol, res, err);
+            break;
+        default:
+            return -1;
+    }
+
+    record_stats(outputs, err);
+    return 0;
+}
+
+
+double integrate(gsl_monte_function *F, double *xl, double *xu, double tol,
+        double *err)
+{
+    return integrate_batch(F, NULL, xl, xu, tol, err);
+}
+
@@ -0,0 +1,86 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#ifndef __INTEGRATION_H
+#define __INTEGRATION_H
+
+#include <gsl/gsl_monte.h>
+#include <gsl/gsl_qrng.h>
+#include <pthread.h>
+
+enum integration_backend {
+    BACKEND_PLAIN,
+    BACKEND_QMC,
+    BACKEND_VEGAS,
+    BACKEND_MISER
+};
+
+struct integration_settings {
+    int backend;
+    const gsl_qrng_type *qrng; // only for BACKEND_QMC
+    size_t calls; // integrand evaluations per integral (at most, if adaptive)
+    double tol_rel; // adaptive backends stop at this relative error
+    int shifts; // random shifts of the QMC point set
+    unsigned long seed;
+    int exact_slots; // closed form for the basic slot integrals
+    int conditional; // chain integrals through the conditional sampler
+    double accuracy; // error target on the detection probability, 0 if none
+};
+typedef struct integration_settings integration_settings_t;
+
+struct integration_stats {
+    pthread_mutex_t mutex;
+    unsigned long count; // integrals computed
+    double max_err; // largest error estimate
+};
+typedef struct integration_stats integration_stats_t;
+
+/*
+ * Evaluates count points at once; coordinate d of point i is at 
+ * x[d * stride + i].
+ */
+typedef void (*batch_function_t)(const double *x, size_t stride, 
+        size_t count, void *params, double *out);
+
+void integration_defaults(integration_settings_t *s);
+int integration_select(integration_settings_t *s, const char *name);
+const char *integration_name(const integration_settings_t *s);
+// Non-zero if integrate_multi can share samples between functions.
+int integration_shares_samples(const integration_settings_t *s);
+
+/*
+ * With tol > 0, sampling stops as soon as the estimated absolute error is 
+ * below tol; calls remains the upper bound.
+ */
+double integrate(gsl_monte_function *F, double *xl, double *xu, double tol,
+        double *err);
+double integrate_batch(gsl_monte_function *F, batch_function_t batch, 
+        double *xl, double *xu, double tol, double *err);
+
+/*
+ * Integrates several functions over the same samples: batch writes 
+ * function m of point i to out[m * stride + i]. Sampling stops on the 
+ * error of function target. Returns -1, without integrating, on the 
+ * adaptive backends since they tailor the samples to a single function.
+ */
+int integrate_multi(size_t dim, size_t outputs, size_t target, 
+        batch_function_t batch, void *params, double *xl, double *xu, 
+        double tol, double *res, double *err);
+
+#endif
@@ -0,0 +1,612 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "memo.h"
+#include "cache_file.h"
+#include "context.h"
+
+#define MEMO_WAYS 8
+#define MEMO_MIN_BUCKETS 8
+#define ARENA_MIN_SIZE 256
+#define ARENA_MAX_SIZE (1 << 16)
+#define MEMO_FLIGHTS 64
+
+#define load_acquire(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define load_relaxed(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define store_relaxed(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELAXED)
+
+struct arena_slot {
+    memo_t *memo;
+    unsigned int gen; // the slot is empty unless it matches the arena's
+    int kept; // already copied to the shared tier
+    uint64_t hash;
+    memo_key_t key;
+    double value;
+    double tol;
+};
+
+struct arena {
+    unsigned int gen;
+    size_t mask;
+    size_t used;
+    struct arena_slot *slot;
+};
+
+static __thread struct arena arena;
+
+// a value being computed, and the threads waiting for it
+struct flight {
+    memo_t *memo; // NULL if the entry is free
+    memo_key_t key;
+    int waiters;
+    int landed;
+    double value;
+    double tol;
+};
+
+static struct flight flights[MEMO_FLIGHTS];
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_cond = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * The chain values do not depend on n itself, only on whether the chain 
+ * reaches the last slots (n - k being -1 or 0); all other n share a key.
+ */
+void memo_key_nk(memo_key_t *key, protocol_params_t *p, int n, int k)
+{
+    switch (n - k) {
+        case -1:
+            n = k - 1;
+            k = -1;
+            break;
+        case 0:
+            n = k;
+            k = 0;
+            break;
+        default:
+            n = 1 + k;
+            k = 1;
+    }
+
+    key->tau = p->tau;
+    key->lambda = p->lambda;
+    key->samples = p->samples;
+    key->n = n;
+    key->k = k;
+    key->pad = 0;
+}
+
+
+static inline uint64_t mix(uint64_t z)
+{
+    // splitmix64 finalizer
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+static uint64_t memo_hash(memo_key_t *key)
+{
+    uint64_t w[sizeof(memo_key_t) / sizeof(uint64_t)], h = 0;
+    int i;
+
+    memcpy(w, key, sizeof(memo_key_t));
+    for (i = 0; i < sizeof(w) / sizeof(w[0]); i++)
+        h = mix(h ^ w[i]);
+    return h != 0 ? h : 1;
+}
+
+
+static const int file_tables[MEMO_COUNT] = {
+    [MEMO_AN_BN] = CACHE_AN_BN,
+    [MEMO_AN_BN1] = CACHE_AN_BN1,
+    [MEMO_BN_AN] = CACHE_BN_AN,
+    [MEMO_BN1_AN] = CACHE_BN1_AN,
+    [MEMO_CHAIN_BN] = CACHE_CHAIN_BN,
+    [MEMO_CHAIN_AN] = CACHE_CHAIN_AN,
+    [MEMO_INTERSECT] = -1,
+    [MEMO_INTERSECT_FUNCG] = -1
+};
+
+
+void memo_set_init(memo_set_t *s)
+{
+    int i;
+
+    for (i = 0; i < MEMO_COUNT; i++) {
+        pthread_mutex_init(&s->memo[i].mutex, NULL);
+        s->memo[i].table = NULL;
+        s->memo[i].file_table = file_tables[i];
+    }
+    s->limit = 0;
+    s->bytes = 0;
+    s->peak = 0;
+    s->share_all = 0;
+}
+
+
+memo_t *memo_get(int id)
+{
+    return &context()->memos.memo[id];
+}
+
+
+// Accounts for size more bytes, unless that would cross the limit.
+static int reserve(size_t size)
+{
+    memo_set_t *s = &context()->memos;
+    size_t cur = load_relaxed(s->bytes), top;
+
+    do {
+        if (s->limit > 0 && cur + size > s->limit)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&s->bytes, &cur, cur + size, 1, 
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    top = load_relaxed(s->peak);
+    while (cur + size > top && !__atomic_compare_exchange_n(&s->peak, &top, 
+                cur + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return 1;
+}
+
+
+static void release(size_t size)
+{
+    __atomic_sub_fetch(&context()->memos.bytes, size, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Slots are changed under a sequence lock, so that a reader never takes 
+ * the key of one value with the value of another.
+ */
+static int read_slot(struct memo_slot *s, uint64_t h, memo_key_t *key, 
+        double *value, double *tol)
+{
+    uint64_t w[sizeof(memo_key_t) / sizeof(uint64_t)];
+    uint64_t *sw = (uint64_t *) &s->key;
+    unsigned int seq;
+    double v, vt;
+    int i;
+
+    do {
+        seq = load_acquire(s->seq);
+        if (load_relaxed(s->hash) != h)
+            return 0;
+        for (i = 0; i < sizeof(w) / sizeof(w[0]); i++)
+            w[i] = load_relaxed(sw[i]);
+        __atomic_load(&s->value, &v, __ATOMIC_RELAXED);
+        __atomic_load(&s->tol, &vt, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != load_relaxed(s->seq));
+
+    if (memcmp(w, key, sizeof(memo_key_t)) != 0)
+        return 0;
+    if (!load_relaxed(s->ref))
+        store_relaxed(s->ref, 1);
+    *value = v;
+    if (tol != NULL)
+        *tol = vt;
+    return 1;
+}
+
+
+// Called with the mutex held.
+static void write_slot(struct memo_slot *s, uint64_t h, memo_key_t *key, 
+        double value, double tol)
+{
+    uint64_t *sw = (uint64_t *) &s->key, *kw = (uint64_t *) key;
+    int i;
+
+    store_relaxed(s->seq, s->seq + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    store_relaxed(s->hash, h);
+    for (i = 0; i < sizeof(memo_key_t) / sizeof(uint64_t); i++)
+        store_relaxed(sw[i], kw[i]);
+    __atomic_store(&s->value, &value, __ATOMIC_RELAXED);
+    __atomic_store(&s->tol, &tol, __ATOMIC_RELAXED);
+    store_relaxed(s->ref, 0);
+    store_release(s->seq, s->seq + 1);
+}
+
+
+static int lookup_shared(memo_t *m, uint64_t h, memo_key_t *key, 
+        double *value, double *tol)
+{
+    struct memo_table *t = load_acquire(m->table);
+    struct memo_slot *s;
+    int i;
+
+    if (t == NULL)
+        return 0;
+
+    s = &t->slot[(h & t->mask) * MEMO_WAYS];
+    for (i = 0; i < MEMO_WAYS; i++)
+        if (read_slot(&s[i], h, key, value, tol))
+            return 1;
+    return 0;
+}
+
+
+static size_t table_size(size_t buckets)
+{
+    return sizeof(struct memo_table) + 
+        buckets * MEMO_WAYS * sizeof(struct memo_slot);
+}
+
+
+void memo_free(memo_t *m)
+{
+    struct memo_table *t, *prev;
+
+    for (t = m->table; t != NULL; t = prev) {
+        prev = t->prev;
+        release(table_size(t->mask + 1));
+        free(t);
+    }
+    m->table = NULL;
+}
+
+
+// No thread may be using the memos any more.
+void memo_set_free(memo_set_t *s)
+{
+    int i;
+
+    for (i = 0; i < MEMO_COUNT; i++) {
+        memo_free(&s->memo[i]);
+        pthread_mutex_destroy(&s->memo[i].mutex);
+    }
+}
+
+
+/*
+ * Called with the mutex held. Readers may still probe the old table, so it
+ * is kept on the prev list rather than freed; the memos live as long as 
+ * their context, and the old tables add up to less than the new one.
+ */
+static struct memo_table *grow(memo_t *m)
+{
+    struct memo_table *old = m->table, *t;
+    struct memo_slot *s, *b;
+    size_t buckets = old != NULL ? 2 * (old->mask + 1) : MEMO_MIN_BUCKETS;
+    size_t i;
+    int j;
+
+    if (!reserve(table_size(buckets)))
+        return NULL;
+    t = calloc(1, table_size(buckets));
+    if (t == NULL) {
+        release(table_size(buckets));
+        return NULL;
+    }
+    t->mask = buckets - 1;
+    t->prev = old;
+
+    // a value whose new bucket is full is dropped
+    if (old != NULL)
+        for (i = 0; i < (old->mask + 1) * MEMO_WAYS; i++) {
+            s = &old->slot[i];
+            if (s->hash == 0)
+                continue;
+            b = &t->slot[(s->hash & t->mask) * MEMO_WAYS];
+            for (j = 0; j < MEMO_WAYS && b[j].hash != 0; j++)
+                ;
+            if (j < MEMO_WAYS) {
+                b[j].hash = s->hash;
+                b[j].key = s->key;
+                b[j].value = s->value;
+                b[j].tol = s->tol;
+                b[j].ref = load_relaxed(s->ref);
+            }
+        }
+
+    store_release(m->table, t);
+    return t;
+}
+
+
+// The first slot of the bucket whose value was not hit since the last pass.
+static struct memo_slot *evict(struct memo_table *t, struct memo_slot *b)
+{
+    unsigned int i;
+
+    for (i = t->hand++; ; i++) {
+        if (!load_relaxed(b[i % MEMO_WAYS].ref))
+            return &b[i % MEMO_WAYS];
+        store_relaxed(b[i % MEMO_WAYS].ref, 0);
+    }
+}
+
+
+static void store_shared(memo_t *m, uint64_t h, memo_key_t *key, 
+        double value, double tol)
+{
+    struct memo_table *t;
+    struct memo_slot *b, *s;
+    int i;
+
+    pthread_mutex_lock(&m->mutex);
+    t = m->table;
+    if (t == NULL && (t = grow(m)) == NULL) {
+        pthread_mutex_unlock(&m->mutex);
+        return;
+    }
+
+    for (;;) {
+        b = &t->slot[(h & t->mask) * MEMO_WAYS];
+        for (i = 0, s = NULL; i < MEMO_WAYS; i++) {
+            if (b[i].hash == h && 
+                    memcmp(&b[i].key, key, sizeof(memo_key_t)) == 0) {
+                s = &b[i];
+                break;
+            }
+            if (s == NULL && b[i].hash == 0)
+                s = &b[i];
+        }
+        if (s != NULL)
+            break;
+        if ((t = grow(m)) == NULL) {
+            t = m->table;
+            s = evict(t, &t->slot[(h & t->mask) * MEMO_WAYS]);
+            break;
+        }
+    }
+
+    write_slot(s, h, key, value, tol);
+    pthread_mutex_unlock(&m->mutex);
+}
+
+
+static struct arena_slot *arena_find(memo_t *m, uint64_t h, memo_key_t *key)
+{
+    struct arena *a = &arena;
+    struct arena_slot *s;
+    size_t i;
+
+    if (a->slot == NULL)
+        return NULL;
+
+    for (i = h & a->mask; ; i = (i + 1) & a->mask) {
+        s = &a->slot[i];
+        if (s->gen != a->gen)
+            return s;
+        if (s->memo == m && s->hash == h && 
+                memcmp(&s->key, key, sizeof(memo_key_t)) == 0)
+            return s;
+    }
+}
+
+
+static int arena_grow(struct arena *a)
+{
+    struct arena_slot *old = a->slot;
+    size_t size = old != NULL ? 2 * (a->mask + 1) : ARENA_MIN_SIZE;
+    size_t i, j;
+
+    if (size > ARENA_MAX_SIZE || !reserve(size * sizeof(struct arena_slot)))
+        return 0;
+    a->slot = calloc(size, sizeof(struct arena_slot));
+    if (a->slot == NULL) {
+        release(size * sizeof(struct arena_slot));
+        a->slot = old;
+        return 0;
+    }
+    a->gen++;
+    if (old == NULL)
+        goto done;
+
+    for (i = 0; i <= a->mask; i++) {
+        if (old[i].gen != a->gen - 1)
+            continue;
+        for (j = old[i].hash & (size - 1); a->slot[j].gen == a->gen; 
+                j = (j + 1) & (size - 1))
+            ;
+        a->slot[j] = old[i];
+        a->slot[j].gen = a->gen;
+    }
+    free(old);
+    release((a->mask + 1) * sizeof(struct arena_slot));
+done:
+    a->mask = size - 1;
+    return 1;
+}
+
+
+void memo_task_begin()
+{
+    arena.gen++;
+    arena.used = 0;
+}
+
+
+void memo_thread_exit()
+{
+    if (arena.slot == NULL)
+        return;
+    free(arena.slot);
+    release((arena.mask + 1) * sizeof(struct arena_slot));
+    memset(&arena, 0, sizeof(arena));
+}
+
+
+int memo_lookup(memo_t *m, memo_key_t *key, double *value, double *tol)
+{
+    uint64_t h = memo_hash(key);
+    struct arena_slot *s = arena_find(m, h, key);
+    double file_tol;
+
+    if (s != NULL && s->gen == arena.gen) {
+        // looked up again: worth sharing
+        if (!s->kept) {
+            store_shared(m, h, key, s->value, s->tol);
+            s->kept = 1;
+        }
+        *value = s->value;
+        if (tol != NULL)
+            *tol = s->tol;
+        return 1;
+    }
+
+    if (lookup_shared(m, h, key, value, tol))
+        return 1;
+    if (m->file_table < 0 || 
+            !cache_file_lookup(m->file_table, key, value, &file_tol))
+        return 0;
+
+    store_shared(m, h, key, *value, file_tol);
+    if (tol != NULL)
+        *tol = file_tol;
+    return 1;
+}
+
+
+void memo_store(memo_t *m, memo_key_t *key, double value, double tol)
+{
+    uint64_t h = memo_hash(key);
+    struct arena *a = &arena;
+    struct arena_slot *s;
+
+    if (m->file_table >= 0)
+        cache_file_append(m->file_table, key, value, tol);
+
+    if (context()->memos.share_all) {
+        store_shared(m, h, key, value, tol);
+        return;
+    }
+
+    // a full arena grows while it may, then starts over
+    if (a->slot == NULL || 2 * (a->used + 1) > a->mask + 1) {
+        if (!arena_grow(a) && a->slot != NULL)
+            memo_task_begin();
+        if (a->slot == NULL) {
+            store_shared(m, h, key, value, tol);
+            return;
+        }
+    }
+
+    s = arena_find(m, h, key);
+    if (s->gen != a->gen) {
+        s->gen = a->gen;
+        s->memo = m;
+        s->hash = h;
+        s->key = *key;
+        a->used++;
+        s->kept = 0;
+    }
+    s->value = value;
+    s->tol = tol;
+    if (s->kept)
+        store_shared(m, h, key, value, tol);
+}
+
+
+void memo_keep(memo_t *m, memo_key_t *key, double value, double tol)
+{
+    store_shared(m, memo_hash(key), key, value, tol);
+}
+
+
+// A landed entry only lingers until its waiters have read the value.
+static struct flight *flight_find(memo_t *m, memo_key_t *key)
+{
+    int i;
+
+    for (i = 0; i < MEMO_FLIGHTS; i++)
+        if (flights[i].memo == m && !flights[i].landed &&
+                memcmp(&flights[i].key, key, sizeof(*key)) == 0)
+            return &flights[i];
+    return NULL;
+}
+
+
+static struct flight *flight_free()
+{
+    int i;
+
+    for (i = 0; i < MEMO_FLIGHTS; i++)
+        if (flights[i].memo == NULL)
+            return &flights[i];
+    return NULL;
+}
+
+
+int memo_wait(memo_t *m, memo_key_t *key, double *value, double *tol)
+{
+    struct flight *f;
+
+    pthread_mutex_lock(&flight_mutex);
+    f = flight_find(m, key);
+    if (f == NULL) {
+        // with the registry full, the caller computes untracked
+        f = flight_free();
+        if (f != NULL) {
+            f->memo = m;
+            f->key = *key;
+            f->waiters = 0;
+            f->landed = 0;
+        }
+        pthread_mutex_unlock(&flight_mutex);
+        return 0;
+    }
+
+    f->waiters++;
+    while (!f->landed)
+        pthread_cond_wait(&flight_cond, &flight_mutex);
+    *value = f->value;
+    if (tol != NULL)
+        *tol = f->tol;
+    if (--f->waiters == 0)
+        f->memo = NULL;
+    pthread_mutex_unlock(&flight_mutex);
+    return 1;
+}
+
+
+void memo_land(memo_t *m, memo_key_t *key, double value, double tol)
+{
+    struct flight *f;
+    int waiters = 0;
+
+    pthread_mutex_lock(&flight_mutex);
+    f = flight_find(m, key);
+    if (f != NULL) {
+        waiters = f->waiters;
+        f->value = value;
+        f->tol = tol;
+        f->landed = 1;
+        if (waiters == 0)
+            f->memo = NULL;
+        else
+            pthread_cond_broadcast(&flight_cond);
+    }
+    pthread_mutex_unlock(&flight_mutex);
+
+    // the value already has several users, so it skips the arena
+    if (waiters > 0)
+        memo_keep(m, key, value, tol);
+}
@@ -0,0 +1,130 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#ifndef __MEMO_H
+#define __MEMO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "wildmac.h"
+
+/*
+ * Canonical cache key. on and active follow from tau, lambda and samples, 
+ * so they are left out; pad is always 0 so that keys compare and hash as 
+ * plain memory.
+ */
+struct memo_key {
+    double tau;
+    double lambda;
+    int samples;
+    int n;
+    int k;
+    int pad;
+};
+typedef struct memo_key memo_key_t;
+
+struct memo_slot {
+    uint64_t hash; // 0 while the slot is empty
+    unsigned int seq; // odd while the slot is being changed
+    unsigned char ref; // set on hits, cleared by the eviction clock
+    memo_key_t key;
+    double value;
+    double tol;
+};
+
+// buckets of MEMO_WAYS slots; a key only lives in its bucket
+struct memo_table {
+    size_t mask;
+    unsigned int hand;
+    struct memo_table *prev;
+    struct memo_slot slot[];
+};
+
+/*
+ * Values live in two tiers. A value just computed goes to the arena of the
+ * running task, private to its thread and dropped when the next task 
+ * starts. Once looked up again, it moves to the shared tier: a table of 
+ * buckets with the values inline, read without locks and growing within 
+ * the memory limit, past which a clock evicts the values not hit since its
+ * last pass. Memos belong to a context, in its memo set or its cache 
+ * file; those of the set with a file_table also keep their values in that
+ * table of the cache file.
+ */
+struct memo {
+    pthread_mutex_t mutex;
+    struct memo_table *table;
+    int file_table; // -1 if not persistent
+};
+typedef struct memo memo_t;
+
+enum memo_id {
+    MEMO_AN_BN,
+    MEMO_AN_BN1,
+    MEMO_BN_AN,
+    MEMO_BN1_AN,
+    MEMO_CHAIN_BN,
+    MEMO_CHAIN_AN,
+    MEMO_INTERSECT,
+    MEMO_INTERSECT_FUNCG,
+    MEMO_COUNT
+};
+
+/*
+ * The memos of a context. The memory of all its memos and of the arenas of
+ * its threads is bounded by limit, 0 for no bound.
+ */
+struct memo_set {
+    memo_t memo[MEMO_COUNT];
+    size_t limit, bytes, peak;
+    int share_all; // skip the arenas, where later queries reuse the values
+};
+typedef struct memo_set memo_set_t;
+
+void memo_set_init(memo_set_t *s);
+void memo_set_free(memo_set_t *s);
+// Frees the tables of m, which no thread may be using any more.
+void memo_free(memo_t *m);
+// Memo id of the context bound to the calling thread.
+memo_t *memo_get(int id);
+
+void memo_key_nk(memo_key_t *key, protocol_params_t *p, int n, int k);
+
+// Returns non-zero on a hit; tol, if not NULL, receives the stored tol.
+int memo_lookup(memo_t *m, memo_key_t *key, double *value, double *tol);
+// Adds the value or overwrites the one already stored for key.
+void memo_store(memo_t *m, memo_key_t *key, double value, double tol);
+// Stores straight into the shared tier, for values known to be reused.
+void memo_keep(memo_t *m, memo_key_t *key, double value, double tol);
+
+/*
+ * Single flight for values worth computing once. memo_wait returns 0 if the
+ * caller is the first to ask for key: it computes the value and passes it 
+ * to memo_land. Otherwise it blocks until the thread computing key lands 
+ * and returns non-zero with that value.
+ */
+int memo_wait(memo_t *m, memo_key_t *key, double *value, double *tol);
+void memo_land(memo_t *m, memo_key_t *key, double value, double tol);
+
+// Starts a new task on this thread, dropping its arena.
+void memo_task_begin();
+// Frees the arena of a thread about to exit.
+void memo_thread_exit();
+
+#endif
@@ -22,12 +22,45 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
 
 #include "common-prints.h"
+#include "integration.h"
+#include "cache_file.h"
+#include "context.h"
 #include "probability.h"
 #include "probability_chain.h"
 #include "chain.h"
 #include "solver.h"
+#include "server.h"
+
+
+#define ROW_HEADER "status\tlatency_ms\tperiod_ms\tbeacon_ms\tcca_ms\t" \
+    "samples\tcurrent"
+#define ROW_EMPTY "\t-\t-\t-\t-\t-\t-"
+
+// queries waiting in server mode, past which they are turned away
+#define SERVER_QUEUE 16
+
+
+static char *cache_path = NULL;
+static context_t *ctx;
+
+
+static void print_integration()
+{
+    printf("   integration: %s, %lu integrals, max est. error %.2e\n",
+            integration_name(&ctx->integration), ctx->stats.count, 
+            ctx->stats.max_err);
+    if (cache_path != NULL)
+        printf("         cache: %lu hits, %lu stored\n", ctx->cache.hits,
+                ctx->cache.appends);
+    printf("        memory: %.1f MB peak in caches\n", 
+            ctx->memos.peak / 1048576.);
+    printf("\n");
+}
 
 
 static void solve_latency(double latency, double probability)
@@ -37,10 +70,11 @@ static void solve_latency(double latency, double probability)
     
     print_boilerplate();
 
-    energy = get_latency_params(latency, probability, &period, &params);
+    energy = get_latency_params(ctx, latency, probability, &period, &params);
 
     if (energy == DBL_MAX) {
         printf("No suitable configuration found.\n");
+        print_integration();
         return;
     }
 
@@ -53,7 +87,8 @@ static void solve_latency(double latency, double probability)
     printf("        beacon: %.2f ms\n", period * params.tau / 2 / M_PI + 
             trx / 100.);
     printf("    CCA period: %.2f ms\n", period * params.tau / 2 / M_PI);
-    printf("       samples: %d\n\n", params.samples);
+    printf("       samples: %d\n", params.samples);
+    print_integration();
 }
 
 
@@ -64,10 +99,12 @@ static void solve_lifetime(double lifetime, double probability)
     
     print_boilerplate();
 
-    latency = get_lifetime_params(lifetime, probability, &period, &params);
+    latency = get_lifetime_params(ctx, lifetime, probability, &period, 
+            &params);
 
     if (latency == DBL_MAX) {
         printf("No suitable configuration found.\n");
+        print_integration();
         return;
     }
 
@@ -81,62 +118,400 @@ static void solve_lifetime(double lifetime, double probability)
     printf("        beacon: %.2f ms\n", period * params.tau / 2 / M_PI + 
             trx / 100.);
     printf("    CCA period: %.2f ms\n", period * params.tau / 2 / M_PI);
-    printf("       samples: %d\n\n", params.samples);
+    printf("       samples: %d\n", params.samples);
+    print_integration();
+}
+
+static int valid_query(char mode, double target, double probability)
+{
+    if (probability <= 0 || probability >= 1)
+        return 0;
+    if (mode == 'l')
+        return target * 100 > (MINttx * 2 + trx) * 2;
+    if (mode == 'e')
+        return target >= 1.;
+    return 0;
+}
+
+
+/*
+ * Parses "l LATENCY PROBABILITY" or "e LIFETIME PROBABILITY", optionally
+ * followed by a deadline in seconds; returns non-zero if invalid, which 
+ * includes anything else left on the line.
+ */
+static int parse_query(const char *line, char *mode, double *target, 
+        double *probability, double *seconds)
+{
+    int used;
 
+    *seconds = 0;
+    if (sscanf(line, " %c %lf %lf%n", mode, target, probability, &used) != 3)
+        return -1;
+    line += used;
+    if (sscanf(line, " %lf%n", seconds, &used) == 1) {
+        if (!(*seconds > 0 && *seconds < LONG_MAX))
+            return -1;
+        line += used;
+    }
+    line += strspn(line, " \t\r\n");
+    if (*line != '\0')
+        return -1;
+    return !valid_query(*mode, *target, *probability);
 }
 
-static int check_args(int narg, char *varg[])
+
+/*
+ * Solves a query into a tab separated row of results, giving up seconds 
+ * after arrival unless seconds is 0.
+ */
+static void answer_query(char mode, double target, double probability, 
+        double seconds, const struct timeval *arrival, char *reply, 
+        size_t size)
+{
+    protocol_params_t params;
+    double energy, latency, period;
+    struct timeval deadline, now;
+
+    if (seconds > 0) {
+        deadline.tv_sec = (long) seconds;
+        deadline.tv_usec = (seconds - deadline.tv_sec) * 1e6;
+        timeradd(arrival, &deadline, &deadline);
+        gettimeofday(&now, NULL);
+        if (timercmp(&now, &deadline, >)) {
+            snprintf(reply, size, "timeout" ROW_EMPTY);
+            return;
+        }
+        solver_set_deadline(ctx, &deadline);
+    } else
+        solver_set_deadline(ctx, NULL);
+
+    if (mode == 'l') {
+        energy = get_latency_params(ctx, target, probability, &period, 
+                &params);
+        latency = target * 100;
+    } else {
+        latency = get_lifetime_params(ctx, target, probability, &period, 
+                &params);
+        energy = 0;
+    }
+
+    if (solver_expired(ctx)) {
+        snprintf(reply, size, "timeout" ROW_EMPTY);
+        return;
+    }
+    if (energy == DBL_MAX || latency == DBL_MAX) {
+        snprintf(reply, size, "none" ROW_EMPTY);
+        return;
+    }
+
+    period /= 100;
+    snprintf(reply, size, "ok\t%.2f\t%.2f\t%.2f\t%.2f\t%d\t", 
+            latency / 100, period, 
+            period * params.tau / 2 / M_PI + trx / 100., 
+            period * params.tau / 2 / M_PI, params.samples);
+    if (mode == 'l')
+        snprintf(reply + strlen(reply), size - strlen(reply), "%f", energy);
+    else
+        snprintf(reply + strlen(reply), size - strlen(reply), "-");
+}
+
+
+/*
+ * Reads a line of in without its newline. Returns 0 at the end of in, or
+ * -1 if the line does not fit: line keeps its start and the rest is 
+ * dropped.
+ */
+static int read_line(FILE *in, char *line, int size)
 {
-    if (narg == 4 && strlen(varg[1]) == 1 && (varg[1][0] == 'l' || 
-            varg[1][0] == 'e'))
+    size_t len;
+    int c;
+
+    if (fgets(line, size, in) == NULL)
         return 0;
+    len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+        line[len - 1] = '\0';
+        return 1;
+    }
+    if (len < size - 1 || (c = getc(in)) == EOF || c == '\n')
+        return 1;
+    while ((c = getc(in)) != EOF && c != '\n')
+        ;
+    return -1;
+}
+
 
+/*
+ * Solves the queries in path, or stdin for "-", one per line as in the 
+ * arguments: "l LATENCY PROBABILITY" or "e LIFETIME PROBABILITY". Every 
+ * query gets a row on stdout, while the progress of the solver goes to 
+ * stderr. The caches and workers carry over from query to query.
+ */
+static int solve_batch(char *path)
+{
+    FILE *in, *out;
+    char line[256], reply[256], mode;
+    double target, probability, seconds;
+    struct timeval arrival;
+    int n = 0, status;
+
+    in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    ctx->memos.share_all = 1;
+
+    fflush(stdout);
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    print_boilerplate();
+    fprintf(out, "# line\tquery\ttarget\tprobability\t" ROW_HEADER "\n");
+
+    while ((status = read_line(in, line, sizeof(line))) != 0) {
+        n++;
+        if (sscanf(line, " %c", &mode) != 1 || mode == '#')
+            continue;
+        if (status < 0 || 
+                parse_query(line, &mode, &target, &probability, &seconds)) {
+            fprintf(out, "%d\t-\t-\t-\tinvalid" ROW_EMPTY "\n", n);
+            fflush(out);
+            continue;
+        }
+
+        printf("query %d: %c %g %g\n", n, mode, target, probability);
+        gettimeofday(&arrival, NULL);
+        answer_query(mode, target, probability, seconds, &arrival, reply, 
+                sizeof(reply));
+        fprintf(out, "%d\t%c\t%g\t%g\t%s\n", n, mode, target, probability,
+                reply);
+        fflush(out);
+    }
+
+    if (in != stdin)
+        fclose(in);
+    fclose(out);
+    print_integration();
+    return 0;
+}
+
+
+static void serve_query(const char *line, const struct timeval *arrival,
+        char *reply, size_t size)
+{
+    double target, probability, seconds;
+    char mode;
+
+    if (parse_query(line, &mode, &target, &probability, &seconds)) {
+        snprintf(reply, size, "invalid" ROW_EMPTY);
+        return;
+    }
+
+    printf("query: %s\n", line);
+    answer_query(mode, target, probability, seconds, arrival, reply, size);
+    fflush(stdout);
+}
+
+
+static int solve_server(char *path)
+{
+    ctx->memos.share_all = 1;
+    print_boilerplate();
+    return server_run(path, SERVER_QUEUE, ROW_EMPTY, serve_query);
+}
+
+
+static int usage(char *name)
+{
     print_boilerplate();
     printf("Invalid arguments. Please run the solver as follows:\n\n"
-            "\t%s (l LATENCY) | (e LIFETIME) PROBABILITY\n\n"
+            "\t%s [-i BACKEND] [-n CALLS] [-t TOL] [-a ACC] [-m] [-u]\n"
+            "\t    [-s] [-k] [-w] [-c FILE] [-M MB] [-j THREADS] [-p]\n"
+            "\t    ((l LATENCY) | (e LIFETIME) PROBABILITY) | (b QUERIES) |\n"
+            "\t    (s SOCKET)\n\n"
             "where:\n"
             "\t `l' gives the best configuration to meet the latency "
             "requirements\n"
             "\t     (LATENCY must be provided in ms).\n"
             "\t `e' gives the best configuration to meet the lifetime "
             "requirements\n"
-            "\t     (LIFETIME must be provided in hours).\n\n",
-            varg[0]);
+            "\t     (LIFETIME must be provided in hours).\n"
+            "\t `b' solves the queries in QUERIES (- for stdin), one per line "
+            "as\n"
+            "\t     `l LATENCY PROBABILITY' or `e LIFETIME PROBABILITY', and "
+            "writes\n"
+            "\t     one tab separated row per query to stdout.\n"
+            "\t `s' serves such queries on the Unix socket SOCKET, answering "
+            "each\n"
+            "\t     line with a row. A query may end with a deadline in "
+            "seconds.\n"
+            "\t `-i' selects the integration backend: plain (default), "
+            "sobol,\n"
+            "\t     niederreiter, halton, reversehalton, vegas or miser.\n"
+            "\t `-n' sets the integrand evaluations per integral.\n"
+            "\t `-t' sets the relative error at which vegas and miser "
+            "stop.\n"
+            "\t `-a' sets the accuracy target on the detection probability "
+            "and\n"
+            "\t     sizes each integral by its share of it.\n"
+            "\t `-m' integrates the basic slot probabilities by Monte Carlo "
+            "instead\n"
+            "\t     of their closed form.\n"
+            "\t `-u' samples the chain integrals uniformly over their box "
+            "instead\n"
+            "\t     of conditionally on the support of each factor.\n"
+            "\t `-s' explores the configurations for a latency slot by slot "
+            "instead\n"
+            "\t     of in order of their lowest possible energy.\n"
+            "\t `-k' lets the workers out of tasks evaluate further taus for "
+            "the\n"
+            "\t     bisections still running.\n"
+            "\t `-w' starts each bisection from a narrow bracket around the "
+            "tau\n"
+            "\t     found for a neighbouring configuration.\n"
+            "\t `-c' keeps the integrals in FILE, to be reused by later runs "
+            "with\n"
+            "\t     the same integration settings.\n"
+            "\t `-M' bounds the memory of the caches, evicting the values "
+            "least\n"
+            "\t     reused past it.\n"
+            "\t `-j' sets the number of workers, by default the CPUs left "
+            "to the\n"
+            "\t     process by its affinity mask and cgroup CPU quota.\n"
+            "\t `-p' pins each worker to one CPU of the affinity mask.\n\n",
+            name);
     return 1;
 }
 
 
+static int check_args(int narg, char *varg[])
+{
+    int opt;
+    long calls = 0;
+    double tol;
+
+    while ((opt = getopt(narg, varg, "i:n:t:a:muskwc:M:j:p")) != -1) {
+        switch (opt) {
+            case 'i':
+                if (integration_select(&ctx->integration, optarg))
+                    return usage(varg[0]);
+                break;
+            case 'n':
+                calls = atol(optarg);
+                if (calls <= 0)
+                    return usage(varg[0]);
+                break;
+            case 't':
+                tol = atof(optarg);
+                if (tol <= 0)
+                    return usage(varg[0]);
+                ctx->integration.tol_rel = tol;
+                break;
+            case 'a':
+                ctx->integration.accuracy = atof(optarg);
+                if (ctx->integration.accuracy <= 0)
+                    return usage(varg[0]);
+                break;
+            case 'm':
+                ctx->integration.exact_slots = 0;
+                break;
+            case 'u':
+                ctx->integration.conditional = 0;
+                break;
+            case 's':
+                ctx->solver.best_first = 0;
+                break;
+            case 'k':
+                ctx->solver.kary = 1;
+                break;
+            case 'w':
+                ctx->solver.warm = 1;
+                break;
+            case 'c':
+                cache_path = optarg;
+                break;
+            case 'M':
+                if (atol(optarg) <= 0)
+                    return usage(varg[0]);
+                ctx->memos.limit = (size_t) atol(optarg) << 20;
+                break;
+            case 'j':
+                ctx->solver.threads = atoi(optarg);
+                if (ctx->solver.threads <= 0)
+                    return usage(varg[0]);
+                break;
+            case 'p':
+                ctx->solver.pin = 1;
+                break;
+            default:
+                return usage(varg[0]);
+        }
+    }
+    if (calls > 0)
+        ctx->integration.calls = calls;
+
+    if (narg - optind == 3 && strlen(varg[optind]) == 1 && 
+            (varg[optind][0] == 'l' || varg[optind][0] == 'e'))
+        return 0;
+    if (narg - optind == 2 && (strcmp(varg[optind], "b") == 0 || 
+                strcmp(varg[optind], "s") == 0))
+        return 0;
+
+    return usage(varg[0]);
+}
+
+
 
 int main(int narg, char *varg[])
 {
     double latency, probability, lifetime;
+    char **args;
+
+    ctx = context_create();
+    assert(ctx != NULL);
+    ctx->verbose = 1;
 
     if (check_args(narg, varg))
         return -1;
+    args = varg + optind - 1;
+
+    if (cache_path != NULL && 
+            cache_file_open(&ctx->cache, cache_path, &ctx->integration))
+        cache_path = NULL;
 
-    switch(varg[1][0]) {
+    switch(args[1][0]) {
         case 'l':
-            sscanf(varg[2], "%lf", &latency);
+            sscanf(args[2], "%lf", &latency);
             assert(latency * 100 > (MINttx * 2 + trx) * 2);
 
-            sscanf(varg[3], "%lf", &probability);
+            sscanf(args[3], "%lf", &probability);
             assert(probability < 1);
             assert(probability > 0);
             
             solve_latency(latency, probability);
             break;
         case 'e':
-            sscanf(varg[2], "%lf", &lifetime);
+            sscanf(args[2], "%lf", &lifetime);
             assert(lifetime >= 1.);
             
-            sscanf(varg[3], "%lf", &probability);
+            sscanf(args[3], "%lf", &probability);
             assert(probability < 1);
             assert(probability > 0);
 
             solve_lifetime(lifetime, probability);
             break;
+        case 'b':
+            if (solve_batch(args[2]))
+                return -1;
+            break;
+        case 's':
+            if (solve_server(args[2]))
+                return -1;
+            break;
     }
+    context_destroy(ctx);
     
     return 0;
 }
-
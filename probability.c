@@ -18,73 +18,71 @@
  * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_monte.h>
-#include <gsl/gsl_monte_plain.h>
 #include <pthread.h>
 
 #include "integrands.h"
+#include "integration.h"
 #include "wildmac.h"
 #include "probability.h"
-#include "hashtable.h"
-#include "hashkeys.h"
+#include "memo.h"
+#include "context.h"
 
-#define CALLS 500000
 
-double probability_an_bn(protocol_params_t *p)
+/*
+ * x[0] spans [a, b]; next selects integrand_n_n1, whose x[2] lies one period
+ * later. Unless disabled, the closed form replaces the Monte Carlo run.
+ */
+static double slot_integral(double a, double b, int next, 
+        protocol_params_t *p, memo_t *memo)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
-   
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
-    
-    hash_key = create_key_protocol_nk(p, 1, 0); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
-    }
+    memo_key_t key;
+    double res, err;
+
+    if (context()->integration.exact_slots)
+        return next ? integral_n_n1(a, b, p) : integral_n_n(a, b, p);
+
+    memo_key_nk(&key, p, 1, 0); 
+    if (memo_lookup(memo, &key, &res, NULL))
+        return res;
+    if (memo_wait(memo, &key, &res, NULL))
+        return res;
 
     double xl[] = {
-        p->tau,
+        a,
         0,
-        0
+        next ? 2 * M_PI : 0
     };
     double xu[] = {
-        p->on - p->lambda,
+        b,
         2 * M_PI - p->on,
-        2 * M_PI - p->on
+        next ? 4 * M_PI - p->on : 2 * M_PI - p->on
     };
-    double res, err;
     gsl_monte_function F ={
-        .f = &integrand_n_n,
+        .f = next ? &integrand_n_n1 : &integrand_n_n,
         .dim = 3,
         .params = p
     };
-    gsl_monte_plain_state *s;
-    const gsl_rng_type *T;
-    gsl_rng *r;
 
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    s = gsl_monte_plain_alloc(F.dim);
-    gsl_monte_plain_integrate(&F, xl, xu, F.dim, CALLS, r, s, &res, &err);
-    gsl_monte_plain_free(s);
+    res = integrate(&F, xl, xu, 0, &err);
 
-    hash_res = malloc(sizeof(double));
-    *hash_res = res;
-    hashtable_insert(hash_table, hash_key, hash_res);
+    memo_store(memo, &key, res, 0);
+    memo_land(memo, &key, res, 0);
 
     return res;
 }
 
 
+double probability_an_bn(protocol_params_t *p)
+{
+    return slot_integral(p->tau, p->on - p->lambda, 0, p, 
+            memo_get(MEMO_AN_BN));
+}
+
+
 double probability_a0_b0(protocol_params_t *p)
 {
 #ifdef CONTACT_VARIABLE
@@ -98,54 +96,8 @@ double probability_a0_b0(protocol_params_t *p)
 
 double probability_an_bn1(protocol_params_t *p)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
-   
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
-    
-    hash_key = create_key_protocol_nk(p, 1, 0); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
-    }
-
-    double xl[] = {
-        p->tau,
-        0,
-        2 * M_PI
-    };
-    double xu[] = {
-        p->on - p->lambda,
-        2 * M_PI - p->on,
-        4 * M_PI - p->on
-    };
-    double res, err;
-    gsl_monte_function F ={
-        .f = &integrand_n_n1,
-        .dim = 3,
-        .params = p
-    };
-    gsl_monte_plain_state *s;
-    const gsl_rng_type *T;
-    gsl_rng *r;
-
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    s = gsl_monte_plain_alloc(F.dim);
-    gsl_monte_plain_integrate(&F, xl, xu, F.dim, CALLS, r, s, &res, &err);
-    gsl_monte_plain_free(s);
-
-    hash_res = malloc(sizeof(double));
-    *hash_res = res;
-    hashtable_insert(hash_table, hash_key, hash_res);
-
-    return res;
+    return slot_integral(p->tau, p->on - p->lambda, 1, p, 
+            memo_get(MEMO_AN_BN1));
 }
 
 
@@ -162,54 +114,8 @@ double probability_a0_bm1(protocol_params_t *p)
 
 double probability_bn_an(protocol_params_t *p)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
-   
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
-    
-    hash_key = create_key_protocol_nk(p, 1, 0); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
-    }
-
-    double xl[] = {
-        p->lambda - p->on,
-        0,
-        0
-    };
-    double xu[] = {
-        -p->tau,
-        2 * M_PI - p->on,
-        2 * M_PI - p->on
-    };
-    double res, err;
-    gsl_monte_function F ={
-        .f = &integrand_n_n,
-        .dim = 3,
-        .params = p
-    };
-    gsl_monte_plain_state *s;
-    const gsl_rng_type *T;
-    gsl_rng *r;
-
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    s = gsl_monte_plain_alloc(F.dim);
-    gsl_monte_plain_integrate(&F, xl, xu, F.dim, CALLS, r, s, &res, &err);
-    gsl_monte_plain_free(s);
-
-    hash_res = malloc(sizeof(double));
-    *hash_res = res;
-    hashtable_insert(hash_table, hash_key, hash_res);
-
-    return res;
+    return slot_integral(p->lambda - p->on, -p->tau, 0, p, 
+            memo_get(MEMO_BN_AN));
 }
 
 
@@ -227,54 +133,8 @@ double probability_b0_a0(protocol_params_t *p)
 
 double probability_bn1_an(protocol_params_t *p)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
-   
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
-    
-    hash_key = create_key_protocol_nk(p, 1, 0); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
-    }
-
-    double xl[] = {
-        p->lambda - p->on,
-        0,
-        2 * M_PI
-    };
-    double xu[] = {
-        -p->tau,
-        2 * M_PI - p->on,
-        4 * M_PI - p->on
-    };
-    double res, err;
-    gsl_monte_function F ={
-        .f = &integrand_n_n1,
-        .dim = 3,
-        .params = p
-    };
-    gsl_monte_plain_state *s;
-    const gsl_rng_type *T;
-    gsl_rng *r;
-
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    s = gsl_monte_plain_alloc(F.dim);
-    gsl_monte_plain_integrate(&F, xl, xu, F.dim, CALLS, r, s, &res, &err);
-    gsl_monte_plain_free(s);
-
-    hash_res = malloc(sizeof(double));
-    *hash_res = res;
-    hashtable_insert(hash_table, hash_key, hash_res);
-
-    return res;
+    return slot_integral(p->lambda - p->on, -p->tau, 1, p, 
+            memo_get(MEMO_BN1_AN));
 }
 
 
@@ -22,252 +22,320 @@
 #include <assert.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_monte.h>
-#include <gsl/gsl_monte_plain.h>
 #include <pthread.h>
 
 #include "wildmac.h"
 #include "probability.h"
-#include "hashtable.h"
-#include "hashkeys.h"
+#include "memo.h"
 #include "integrands.h"
+#include "integration.h"
+#include "chain_sampler.h"
+#include "context.h"
 
-#define CALLS 500000
 #define CONSEC5(p) (3 * p->tau * (p->samples + 1) - p->lambda)
 
 
-static double probability_chain_an(int n, int k, protocol_params_t *p)
+/*
+ * A cached value is good enough if it was computed for a target as tight;
+ * cached_tol is the absolute error target it was computed for, 0 if none.
+ */
+static int chain_value_usable(double cached_tol, double tol)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
-
-    int i, j, diff;
-    double xl[45], xu[45];
-    double res, err;
-    chain_params_t chain_params = {
-        .n = n,
-        .k = k,
-        .protocol = p
-    };
-    gsl_monte_function F = {
-        .f = &integrand_chain_an,
-        .dim = 2 * k + 1,
-        .params = &chain_params
-    };
-    gsl_monte_plain_state *s;
-    const gsl_rng_type *T;
-    gsl_rng *r;
-
-    assert(k > 0);
-    assert(k < 6);
-
-    if (k > n * 2 + 1)
-        return 0;
+    if (cached_tol == 0)
+        return 1;
+    return tol > 0 && cached_tol <= tol;
+}
 
-    if (k > 3 && CONSEC5(p) < 2 * M_PI)
-        return 0; 
-    
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
-    
-    hash_key = create_key_protocol_nk(p, n, k); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
-    }
 
-    F.dim = 0;
+static int box_chain_an(int n, int k, protocol_params_t *p, double *xl, 
+        double *xu)
+{
+    int i, j, diff, dim = 0;
 
     for (i = 0; i < k; i++) {
         diff = i / 2 + 1;
         
         for (j = 0; j < i; j++) {
             if (j % 2 == 0) { 
-                xl[F.dim] = p->on - 4 * M_PI;
-                xu[F.dim++] = 2 * M_PI - p->on;
+                xl[dim] = p->on - 4 * M_PI;
+                xu[dim++] = 2 * M_PI - p->on;
             } else {
-                xl[F.dim] = p->on - 2 * M_PI;
-                xu[F.dim++] = 4 * M_PI - p->on;
+                xl[dim] = p->on - 2 * M_PI;
+                xu[dim++] = 4 * M_PI - p->on;
             }
             
-            xl[F.dim] = 2 * (n - diff) * M_PI;
-            xu[F.dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
+            xl[dim] = 2 * (n - diff) * M_PI;
+            xu[dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
             
             if ((i + j) % 2 == 0)
                 diff--;
 
-            xl[F.dim] = 2 * (n - diff) * M_PI;
-            xu[F.dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
+            xl[dim] = 2 * (n - diff) * M_PI;
+            xu[dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
         }
 
         if (i % 2 == 1) {
-            xl[F.dim] = p->tau;
-            xu[F.dim++] = p->on - p->lambda;
+            xl[dim] = p->tau;
+            xu[dim++] = p->on - p->lambda;
         } else {
-            xl[F.dim] = p->lambda - p->on;
-            xu[F.dim++] = -p->tau;
+            xl[dim] = p->lambda - p->on;
+            xu[dim++] = -p->tau;
         }
         
-        xl[F.dim] = 2 * (n - diff) * M_PI;
-        xu[F.dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
+        xl[dim] = 2 * (n - diff) * M_PI;
+        xu[dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
         
         diff--;
         
-        xl[F.dim] = 2 * (n - diff) * M_PI;
-        xu[F.dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
+        xl[dim] = 2 * (n - diff) * M_PI;
+        xu[dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
     }
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    s = gsl_monte_plain_alloc(F.dim);
-    gsl_monte_plain_integrate(&F, xl, xu, F.dim, CALLS, r, s, &res, &err);
-    gsl_monte_plain_free(s);
-
-    gsl_rng_free(r);
-#ifdef CONTACT_VARIABLE
-    if (n * 2 + 1 - k == 1)
-        res *= (2 * M_PI + p->on - 2 * p->lambda) / 4 / M_PI;
-    if (n * 2 + 1 - k == 0)
-        res *= (2 * M_PI - p->lambda) / (2 * M_PI - p->on) / 2 / M_PI;
-#endif
-
-    hash_res = malloc(sizeof(double));
-    *hash_res = res;
-    hashtable_insert(hash_table, hash_key, hash_res);
-
-    return res;
+    return dim;
 }
 
 
-static double probability_chain_bn(int n, int k, protocol_params_t *p)
+static int box_chain_bn(int n, int k, protocol_params_t *p, double *xl, 
+        double *xu)
 {
-    static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
-    static struct hashtable *hash_table = NULL;
-    hashkey_t *hash_key;
-    double *hash_res;
-
-    int i, j, diff;
-    double xl[45], xu[45];
-    double res, err;
-    chain_params_t chain_params = {
-        .n = n,
-        .k = k,
-        .protocol = p
-    };
-    gsl_monte_function F = {
-        .f = &integrand_chain_bn,
-        .dim = 2 * k + 1,
-        .params = &chain_params
-    };
-    gsl_monte_plain_state *s;
-    const gsl_rng_type *T;
-    gsl_rng *r;
-
-    assert(k > 0);
-    assert(k < 6);
-
-    if (k > 2 * (n + 1))
-        return 0;
-
-    if (k > 3 && CONSEC5(p) < 2 * M_PI)
-        return 0; 
-    
-    pthread_mutex_lock(&hash_mutex);
-    if (hash_table == NULL)
-        hash_table = create_hashtable(16, key_hash, key_equal, &hash_mutex);
-    pthread_mutex_unlock(&hash_mutex);
-    
-    hash_key = create_key_protocol_nk(p, n, k); 
-    hash_res = hashtable_search(hash_table, hash_key);
-    if (hash_res != NULL) {
-        free(hash_key);
-        return *hash_res;
-    }
-
-    F.dim = 0;
+    int i, j, diff, dim = 0;
 
     for (i = 0; i < k; i++) {
         diff = (i + 1) / 2;
 
         for (j = 0; j < i; j++) {
             if (j % 2 == 1) { 
-                xl[F.dim] = p->on - 4 * M_PI;
-                xu[F.dim++] = 2 * M_PI - p->on;
+                xl[dim] = p->on - 4 * M_PI;
+                xu[dim++] = 2 * M_PI - p->on;
             } else {
-                xl[F.dim] = p->on - 2 * M_PI;
-                xu[F.dim++] = 4 * M_PI - p->on;
+                xl[dim] = p->on - 2 * M_PI;
+                xu[dim++] = 4 * M_PI - p->on;
             }
             
-            xl[F.dim] = 2 * (n - diff) * M_PI;
-            xu[F.dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
+            xl[dim] = 2 * (n - diff) * M_PI;
+            xu[dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
             
             if ((i + j) % 2 == 1)
                 diff--;
 
-            xl[F.dim] = 2 * (n - diff) * M_PI;
-            xu[F.dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
+            xl[dim] = 2 * (n - diff) * M_PI;
+            xu[dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
         }
 
         if (i % 2 == 0) {
-            xl[F.dim] = p->tau;
-            xu[F.dim++] = p->on - p->lambda;
+            xl[dim] = p->tau;
+            xu[dim++] = p->on - p->lambda;
         } else {
-            xl[F.dim] = p->lambda - p->on;
-            xu[F.dim++] = -p->tau;
+            xl[dim] = p->lambda - p->on;
+            xu[dim++] = -p->tau;
         }
 
-        xl[F.dim] = 2 * (n - diff) * M_PI;
-        xu[F.dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
+        xl[dim] = 2 * (n - diff) * M_PI;
+        xu[dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
         
-        xl[F.dim] = 2 * (n - diff) * M_PI;
-        xu[F.dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
+        xl[dim] = 2 * (n - diff) * M_PI;
+        xu[dim++] = 2 * (n + 1 - diff) * M_PI - p->on;
     }
 
-    T = gsl_rng_default;
-    r = gsl_rng_alloc(T);
-    s = gsl_monte_plain_alloc(F.dim);
-    gsl_monte_plain_integrate(&F, xl, xu, F.dim, CALLS, r, s, &res, &err);
-    gsl_monte_plain_free(s);
+    return dim;
+}
+
+
+// The highest order whose chain can be non-zero.
+static int max_order(int an, int n, protocol_params_t *p)
+{
+    int k = an ? n * 2 + 1 : 2 * (n + 1);
+
+    if (k > 3 && CONSEC5(p) < 2 * M_PI)
+        k = 3;
+    return k < CHAIN_MAX_STAGES ? k : CHAIN_MAX_STAGES;
+}
+
 
-    gsl_rng_free(r);
+static double contact_scale(int an, int n, int k, protocol_params_t *p)
+{
 #ifdef CONTACT_VARIABLE
-    if (2 * (n + 1) - k == 1)
-        res *= (2 * M_PI + p->on - 2 * p->lambda) / 4 / M_PI;
-    if (2 * (n + 1) - k == 0)
-        res *= (2 * M_PI - p->lambda) / (2 * M_PI - p->on) / 2 / M_PI;
+    int left = an ? n * 2 + 1 - k : 2 * (n + 1) - k;
+
+    if (left == 1)
+        return (2 * M_PI + p->on - 2 * p->lambda) / 4 / M_PI;
+    if (left == 0)
+        return (2 * M_PI - p->lambda) / (2 * M_PI - p->on) / 2 / M_PI;
 #endif
+    return 1;
+}
+
+
+/*
+ * Integrates the chain of order k over the box, either directly or, by 
+ * default, through the conditional sampler over the unit cube.
+ */
+static double integrate_chain(int an, int n, int k, protocol_params_t *p, 
+        double *xl, double *xu, int dim, double tol)
+{
+    chain_params_t chain_params;
+    gsl_monte_function F = {
+        .f = integrand_chain(an, k),
+        .dim = dim,
+        .params = &chain_params
+    };
+    chain_sampler_t sampler;
+    double ul[45], uu[45], err;
+    int i;
+
+    chain_params_init(&chain_params, n, k, p);
+    if (!context()->integration.conditional)
+        return integrate_batch(&F, an ? &integrand_chain_an_batch : 
+                &integrand_chain_bn_batch, xl, xu, tol, &err);
+
+    if (chain_sampler_init(&sampler, an, n, k, p, xl, xu) < k)
+        return 0;
+    for (i = 0; i < dim; i++) {
+        ul[i] = 0;
+        uu[i] = 1;
+    }
+    F.f = &chain_sampler_weight;
+    F.params = &sampler;
+    return integrate_batch(&F, &chain_sampler_weight_batch, ul, uu, tol, 
+            &err);
+}
+
+
+/*
+ * One conditional sampling pass over the chain of order kmax estimates 
+ * every order up to it, since each is a prefix of the next.
+ */
+static int shares_chain_orders()
+{
+    const integration_settings_t *set = &context()->integration;
+
+    return set->conditional && integration_shares_samples(set);
+}
 
-    hash_res = malloc(sizeof(double));
-    *hash_res = res;
-    hashtable_insert(hash_table, hash_key, hash_res);
 
-    return res;
+static void integrate_chain_orders(int an, int n, int kmax, 
+        protocol_params_t *p, double *xl, double *xu, int dim, double *res)
+{
+    chain_sampler_t sampler;
+    double ul[45], uu[45], err[CHAIN_MAX_STAGES];
+    int i;
+
+    chain_sampler_init(&sampler, an, n, kmax, p, xl, xu);
+    for (i = 0; i < dim; i++) {
+        ul[i] = 0;
+        uu[i] = 1;
+    }
+    integrate_multi(dim, kmax, kmax - 1, &chain_sampler_prefix_batch,
+            &sampler, ul, uu, 0, res, err);
+}
+
+
+/*
+ * Keeps the cached value unless the new one was computed for a tighter tol.
+ * A shared value also goes straight to the shared tier, for other threads.
+ */
+static void store_chain_value(memo_t *memo, protocol_params_t *p, int n, 
+        int k, double res, double tol, int shared)
+{
+    memo_key_t key;
+    double cached, cached_tol;
+
+    memo_key_nk(&key, p, n, k);
+    if (memo_lookup(memo, &key, &cached, &cached_tol) && 
+            chain_value_usable(cached_tol, tol))
+        return;
+    memo_store(memo, &key, res, tol);
+    if (shared)
+        memo_keep(memo, &key, res, tol);
 }
 
 
-double probability_ank_bn(int n, int k, protocol_params_t *p)
+static double probability_chain(int an, int n, int k, protocol_params_t *p, 
+        double tol)
 {
-    return probability_chain_bn(n, 2 * k + 1, p);
+    memo_t *memo = memo_get(an ? MEMO_CHAIN_AN : MEMO_CHAIN_BN);
+    memo_key_t key, flight;
+    double cached, cached_tol;
+
+    int i, dim, kmax, fused;
+    double xl[45], xu[45];
+    double res[CHAIN_MAX_STAGES];
+
+    assert(k > 0);
+    assert(k < 6);
+
+    kmax = max_order(an, n, p);
+    if (k > kmax)
+        return 0;
+    
+    memo_key_nk(&key, p, n, k); 
+    if (memo_lookup(memo, &key, &cached, &cached_tol) && 
+            chain_value_usable(cached_tol, tol))
+        return cached;
+
+    /*
+     * Under an error target every order is sized on its own, since the 
+     * higher orders would only add work per sample. Otherwise one pass 
+     * stores all orders, so its callers share the flight of order kmax and
+     * read their own order once it lands.
+     */
+    fused = tol == 0 && shares_chain_orders();
+    if (fused)
+        memo_key_nk(&flight, p, n, kmax);
+    else
+        flight = key;
+    while (memo_wait(memo, &flight, &cached, &cached_tol)) {
+        if (fused && k != kmax && 
+                !memo_lookup(memo, &key, &cached, &cached_tol))
+            continue;
+        if (chain_value_usable(cached_tol, tol))
+            return cached;
+    }
+
+    if (fused) {
+        if (an)
+            dim = box_chain_an(n, kmax, p, xl, xu);
+        else
+            dim = box_chain_bn(n, kmax, p, xl, xu);
+        integrate_chain_orders(an, n, kmax, p, xl, xu, dim, res);
+        for (i = 0; i < kmax; i++) {
+            res[i] *= contact_scale(an, n, i + 1, p);
+            store_chain_value(memo, p, n, i + 1, res[i], 0, i + 1 != k);
+        }
+        memo_land(memo, &flight, res[kmax - 1], 0);
+        return res[k - 1];
+    }
+
+    if (an)
+        dim = box_chain_an(n, k, p, xl, xu);
+    else
+        dim = box_chain_bn(n, k, p, xl, xu);
+    res[0] = integrate_chain(an, n, k, p, xl, xu, dim, tol) * 
+        contact_scale(an, n, k, p);
+    store_chain_value(memo, p, n, k, res[0], tol, 0);
+    memo_land(memo, &key, res[0], tol);
+    return res[0];
 }
 
 
-double probability_bnk_bn(int n, int k, protocol_params_t *p)
+double probability_ank_bn(int n, int k, protocol_params_t *p, double tol)
 {
-    return probability_chain_bn(n, 2 * k, p);
+    return probability_chain(0, n, 2 * k + 1, p, tol);
 }
 
 
-double probability_ank_an(int n, int k, protocol_params_t *p)
+double probability_bnk_bn(int n, int k, protocol_params_t *p, double tol)
 {
-    return probability_chain_an(n, 2 * k, p);
+    return probability_chain(0, n, 2 * k, p, tol);
 }
 
 
-double probability_bnk_an(int n, int k, protocol_params_t *p)
+double probability_ank_an(int n, int k, protocol_params_t *p, double tol)
 {
-    return probability_chain_an(n, 2 * k - 1, p);
+    return probability_chain(1, n, 2 * k, p, tol);
 }
 
+
+double probability_bnk_an(int n, int k, protocol_params_t *p, double tol)
+{
+    return probability_chain(1, n, 2 * k - 1, p, tol);
+}
@@ -20,9 +20,13 @@
 #ifndef __PROBABILITY_CHAIN
 #define __PROBABILITY_CHAIN
 
-double probability_ank_bn(int n, int k, protocol_params_t *p);
-double probability_bnk_bn(int n, int k, protocol_params_t *p);
-double probability_ank_an(int n, int k, protocol_params_t *p);
-double probability_bnk_an(int n, int k, protocol_params_t *p);
+/*
+ * tol is the absolute error the caller can afford on the result (0 for the
+ * full sampling budget).
+ */
+double probability_ank_bn(int n, int k, protocol_params_t *p, double tol);
+double probability_bnk_bn(int n, int k, protocol_params_t *p, double tol);
+double probability_ank_an(int n, int k, protocol_params_t *p, double tol);
+double probability_bnk_an(int n, int k, protocol_params_t *p, double tol);
 
 #endif
@@ -0,0 +1,92 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#include <math.h>
+#include <assert.h>
+
+#include "rootfind.h"
+
+// the truncation constants suggested by Oliveira and Takahashi
+#define ITP_K1 0.2
+#define ITP_N0 1
+
+
+void rootfind_init(rootfind_t *r, double a, double b, double fa, double fb, 
+        double eps)
+{
+    int half;
+
+    assert(a < b);
+    assert(fa < 0 && fb >= 0);
+
+    r->a = a;
+    r->b = b;
+    r->fa = fa;
+    r->fb = fb;
+    r->eps = eps;
+    r->k1 = ITP_K1 / (b - a);
+    r->step = 0;
+
+    half = ceil(log2((b - a) / (2 * eps)));
+    r->max_steps = (half > 0 ? half : 0) + ITP_N0;
+}
+
+
+double rootfind_next(rootfind_t *r)
+{
+    double width = r->b - r->a;
+    double mid = r->a + width / 2;
+    double radius = r->eps * ldexp(1, r->max_steps - r->step) - width / 2;
+    double delta = r->k1 * width * width;
+    double x, sigma;
+
+    r->step++;
+
+    // interpolate
+    x = (r->b * r->fa - r->a * r->fb) / (r->fa - r->fb);
+
+    // truncate
+    sigma = mid > x ? 1 : -1;
+    if (delta <= fabs(mid - x))
+        x += sigma * delta;
+    else
+        x = mid;
+
+    // project onto the interval keeping the bisection worst case
+    if (radius < 0)
+        radius = 0;
+    if (fabs(x - mid) > radius)
+        x = mid - sigma * radius;
+    return x;
+}
+
+
+void rootfind_update(rootfind_t *r, double x, double fx)
+{
+    if (x <= r->a || x >= r->b)
+        return;
+
+    if (fx < 0) {
+        r->a = x;
+        r->fa = fx;
+    } else {
+        r->b = x;
+        r->fb = fx;
+    }
+}
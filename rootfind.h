@@ -0,0 +1,47 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#ifndef __ROOTFIND_H
+#define __ROOTFIND_H
+
+/*
+ * Bracketing root finder for an increasing f, stepping by ITP (interpolate,
+ * truncate, project): regula falsi pulled towards the midpoint, so that it
+ * converges superlinearly on smooth f and never needs more steps than 
+ * bisection would to shrink the bracket to 2 eps. Given only the signs of
+ * f, +1 or -1, every step is the midpoint.
+ */
+struct rootfind {
+    double a, b; // f(a) < 0 <= f(b)
+    double fa, fb;
+    double eps;
+    double k1;
+    int step;
+    int max_steps;
+};
+typedef struct rootfind rootfind_t;
+
+void rootfind_init(rootfind_t *r, double a, double b, double fa, double fb, 
+        double eps);
+// Returns the next x at which to evaluate f.
+double rootfind_next(rootfind_t *r);
+// Narrows the bracket by f(x); an x outside of it is ignored.
+void rootfind_update(rootfind_t *r, double x, double fx);
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * wildmac-solver - returns the proper configuration of the wildmac protocol,
+ * given a desired detection latency and probability.
+ * Copyright (C) 2010  Stefan Guna
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see 
+ * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+#define QUERY_SIZE 256
+
+
+struct query {
+    char line[QUERY_SIZE];
+    char reply[QUERY_SIZE];
+    struct timeval arrival;
+    int done;
+    struct query *next;
+};
+
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t pending;
+    pthread_cond_t answered;
+    struct query *head, *tail;
+    int queued;
+    int max_queued;
+    const char *empty;
+} queue = {
+    PTHREAD_MUTEX_INITIALIZER, 
+    PTHREAD_COND_INITIALIZER, 
+    PTHREAD_COND_INITIALIZER, 
+    NULL, NULL, 0, 0, ""
+};
+
+
+// Queues q and waits for its answer; returns non-zero if the queue is full.
+static int submit(struct query *q)
+{
+    pthread_mutex_lock(&queue.mutex);
+    if (queue.queued >= queue.max_queued) {
+        pthread_mutex_unlock(&queue.mutex);
+        return -1;
+    }
+
+    q->done = 0;
+    q->next = NULL;
+    if (queue.tail != NULL)
+        queue.tail->next = q;
+    else
+        queue.head = q;
+    queue.tail = q;
+    queue.queued++;
+    pthread_cond_signal(&queue.pending);
+
+    while (!q->done)
+        pthread_cond_wait(&queue.answered, &queue.mutex);
+    pthread_mutex_unlock(&queue.mutex);
+    return 0;
+}
+
+
+static void *client_thread(void *data)
+{
+    int fd = (long) data;
+    FILE *in = fdopen(fd, "r"), *out = fdopen(dup(fd), "w");
+    struct query q;
+    size_t len;
+    int c;
+
+    if (in == NULL || out == NULL)
+        goto client_close;
+
+    while (fgets(q.line, sizeof(q.line), in) != NULL) {
+        len = strlen(q.line);
+        if (len > 0 && q.line[len - 1] == '\n')
+            q.line[--len] = '\0';
+        else if (len == sizeof(q.line) - 1) {
+            // no query is this long; the rest of the line is dropped
+            while ((c = getc(in)) != EOF && c != '\n')
+                ;
+            fprintf(out, "invalid%s\n", queue.empty);
+            fflush(out);
+            continue;
+        }
+        if (len == 0)
+            continue;
+
+        gettimeofday(&q.arrival, NULL);
+        if (submit(&q))
+            fprintf(out, "busy%s\n", queue.empty);
+        else
+            fprintf(out, "%s\n", q.reply);
+        fflush(out);
+    }
+
+client_close:
+    if (in != NULL)
+        fclose(in);
+    else
+        close(fd);
+    if (out != NULL)
+        fclose(out);
+    return NULL;
+}
+
+
+/*
+ * Errors of accept that pass: a client that left or a signal are retried 
+ * at once, while a shortage of descriptors or memory waits for clients 
+ * to leave, backing off up to a second. Anything else is fatal for sock.
+ */
+static void *accept_thread(void *data)
+{
+    int sock = (long) data, fd;
+    useconds_t backoff = 0;
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (;;) {
+        fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            switch (errno) {
+                case EINTR:
+                case EAGAIN:
+                case ECONNABORTED:
+                case EPROTO:
+                    continue;
+                case EMFILE:
+                case ENFILE:
+                case ENOBUFS:
+                case ENOMEM:
+                    perror("accept");
+                    backoff = backoff ? 2 * backoff : 10000;
+                    if (backoff > 1000000)
+                        backoff = 1000000;
+                    usleep(backoff);
+                    continue;
+            }
+            perror("accept");
+            exit(1);
+        }
+        backoff = 0;
+
+        if (pthread_create(&thread, &attr, client_thread, 
+                    (void *) (long) fd)) {
+            dprintf(fd, "busy%s\n", queue.empty);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+
+int server_run(const char *path, int max_queued, const char *empty,
+        query_handler_t handler)
+{
+    struct sockaddr_un addr;
+    struct query *q;
+    pthread_t thread;
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) || 
+            listen(sock, SOMAXCONN)) {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+
+    // a client may leave before its answer is written
+    signal(SIGPIPE, SIG_IGN);
+
+    queue.max_queued = max_queued;
+    queue.empty = empty;
+    if (pthread_create(&thread, NULL, accept_thread, (void *) (long) sock)) {
+        close(sock);
+        return -1;
+    }
+    printf("serving on %s\n", path);
+    fflush(stdout);
+
+    for (;;) {
+        pthread_mutex_lock(&queue.mutex);
+        while (queue.head == NULL)
+            pthread_cond_wait(&queue.pending, &queue.mutex);
+        q = queue.head;
+        pthread_mutex_unlock(&queue.mutex);
+
+        handler(q->line, &q->arrival, q->reply, sizeof(q->reply));
+
+        pthread_mutex_lock(&queue.mutex);
+        queue.head = q->next;
+        if (queue.head == NULL)
+            queue.tail = NULL;
+        queue.queued--;
+        q->done = 1;
+        pthread_cond_broadcast(&queue.answered);
+        pthread_mutex_unlock(&queue.mutex);
+    }
+    return 0;
+}
@@ -17,21 +17,28 @@
  * along with this program. If not, see 
  * http://www.gnu.org/licenses/gpl-3.0-standalone.html.
  */
-#ifndef __HASHKEYS_H
-#define __HASHKEYS_H
+#ifndef __SERVER_H
+#define __SERVER_H
 
-#include "wildmac.h"
-
-struct key {
-    int n;
-    int k;
-    protocol_params_t p;
-};
-typedef struct key hashkey_t;
+#include <stddef.h>
+#include <sys/time.h>
 
+/*
+ * Answers one query line into reply. arrival is when the query was 
+ * received, for deadlines that count the time spent queued.
+ */
+typedef void (*query_handler_t)(const char *query, 
+        const struct timeval *arrival, char *reply, size_t size);
 
-hashkey_t *create_key_protocol_nk(protocol_params_t *p, int n, int k);
-unsigned int key_hash(void *k);
-int key_equal(void *k1, void *k2);
+/*
+ * Serves queries on the Unix socket at path, one per line, each answered 
+ * by a line. Queries are solved one at a time, in order of arrival; past 
+ * max_queued waiting, further ones are answered "busy" at once. A line 
+ * too long to be a query is answered "invalid". These replies of the 
+ * server are followed by empty, which fills the rest of a row. Only 
+ * returns on errors.
+ */
+int server_run(const char *path, int max_queued, const char *empty,
+        query_handler_t handler);
 
 #endif
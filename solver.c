@@ -19,57 +19,174 @@
  */
 #include <sys/time.h>
 #include <assert.h>
+#include <stdarg.h>
 #include <gsl/gsl_math.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <limits.h>
 
 #include "solver.h"
+#include "context.h"
 #include "chain.h"
+#include "memo.h"
+#include "rootfind.h"
+#include "cpus.h"
 #include "wildmac.h"
-#include "pthread_sem.h"
 
-
-static int thread_cnt = 0;
+// tasks per worker and round, at least
+#define SWEEP_BATCH 4
+// taus evaluated at once by the k-ary search
+#define KARY_MAX 8
+// half width of a warm bracket, relative to the predicted tau
+#define WARM_WIDTH 0.02
+// energy spread at which a tau bracket is closed, relative
+#define BRACKET_TOL (TOL_REL / 2)
 
 
 enum {
-    NO_SOLUTION = -1,
+    PRUNED = -2,
+    NO_SOLUTION,
     TRIVIAL,
     TOL_REACHED,
-    MAXCALL_REACHED
+    MAXCALL_REACHED,
+    BRACKETED
 };
 
 
 struct worker_task {
+    struct worker_data *wd; // of the call the task belongs to
     double lb, ub;
     double T;
     int slot;
+    int order; // position in the sweep
+    double bound; // energy at lb
     protocol_params_t pc;
 };
 
 
-struct worker_data {
-    double probability;
+/*
+ * The owner pops tasks from the head, idle workers steal from the tail, or
+ * take the best head of all in best-first order.
+ */
+struct task_deque {
+    pthread_mutex_t mutex;
     struct worker_task *task;
+    int head, tail;
+    int size;
+};
+
+
+// a tau evaluated on behalf of the worker bisecting
+struct probe {
+    protocol_params_t pc;
+    int slot;
+    double prob;
+    int done;
+    struct probe *next;
+};
 
-    int *finish;
+
+// tau solved for a task, as a fraction of the way from lb to ub
+struct solved_tau {
+    int slot;
+    int samples; // 0 if the entry is empty
+    double at;
+};
+
+
+// the taus solved in the current sweep, by slot and samples
+struct tau_table {
+    pthread_mutex_t mutex;
+    size_t mask;
+    size_t used;
+    struct solved_tau *entry;
+};
+
+
+/*
+ * A call deals its tasks to the deques of the workers and waits for its 
+ * own count of pending tasks to reach zero: the worker finishing the last
+ * one wakes it, while the others already look for more work. Workers out 
+ * of tasks run the probes posted by the others. The pool of a context is 
+ * started on first use and kept for later calls.
+ */
+struct worker_pool {
+    context_t *ctx;
+    int size;
+    int online;
+    pthread_t *threads;
+    struct task_deque *deque;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work; // tasks or probes posted, or the pool finishing
+    unsigned int posted; // bumped whenever tasks are dealt
+    int finish;
+    int best_first;
+
+    pthread_cond_t assist; // probes done
+    struct probe *probes; // posted, not yet taken
+    int working; // workers running a task
+};
+
+
+struct worker_data {
+    struct worker_pool *pool;
+    double probability;
 
     /* result is outputed in the following */
     double *energy;
     int *slots;
+    int found; // order of the task behind slots
+    struct tau_table taus;
     protocol_params_t *params;
     double *period;
 
-    pthread_sem_t *sem_new_task;
-    pthread_sem_t *sem_task_buffered;
-    pthread_sem_t *sem_worker_available;
-    pthread_mutex_t *task_mutex;
+    unsigned long total_states, states_completed;
+    struct timeval start;
+
+    pthread_mutex_t result_mutex;
+
+    int pending; // tasks dealt and not yet run, under the pool mutex
+    pthread_cond_t done; // pending reached 0
 };
 
 
+// the slots of a latency not yet handed to the pool
+struct task_sweep {
+    double latency;
+    int slot, max_slots;
+    int order;
+    struct worker_task *tasks;
+    int size;
+};
+
+
+void solver_defaults(solver_settings_t *s)
+{
+    s->best_first = 1;
+    s->kary = 0;
+    s->warm = 0;
+    s->threads = 0;
+    s->pin = 0;
+}
+
+
+// Progress of the solve, printed for verbose contexts only.
+static void report(const char *format, ...)
+{
+    va_list ap;
+
+    if (!context()->verbose)
+        return;
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+}
+
+
 static inline double energy_per_time(double tau, double lambda, int samples)
 {
     double res = 0;
@@ -82,434 +199,917 @@ static inline double energy_per_time(double tau, double lambda, int samples)
 }
 
 
+static inline double load_energy(double *energy)
+{
+    double res;
+
+    __atomic_load(energy, &res, __ATOMIC_RELAXED);
+    return res;
+}
+
+
+// Runs a probe with the pool mutex held, releasing it meanwhile.
+static void run_probe(struct worker_pool *pool, struct probe *pr)
+{
+    pthread_mutex_unlock(&pool->mutex);
+    SET_ON(&pr->pc);
+    SET_ACTIVE(&pr->pc);
+    pr->prob = contact_union(pr->slot, &pr->pc);
+    pthread_mutex_lock(&pool->mutex);
+
+    pr->done = 1;
+    pthread_cond_broadcast(&pool->assist);
+}
+
+
+static struct probe *take_probe(struct worker_pool *pool)
+{
+    struct probe *pr = pool->probes;
+
+    if (pr != NULL)
+        pool->probes = pr->next;
+    return pr;
+}
+
+
+// Taus to evaluate at once: one, plus one for each worker out of tasks.
+static int probe_width(struct worker_pool *pool)
+{
+    int idle;
+
+    if (pool == NULL)
+        return 1;
+    idle = pool->size - __atomic_load_n(&pool->working, __ATOMIC_RELAXED);
+    return idle + 1 < KARY_MAX ? idle + 1 : KARY_MAX;
+}
+
+
+/*
+ * Evaluates contact_union at count taus, posting all but the first for the
+ * idle workers. While waiting for them, the caller runs the probes still 
+ * posted, its own or not, so that it never waits on a busy worker. params 
+ * is left at tau[0].
+ */
+static void probe_taus(struct worker_pool *pool, int slot, 
+        protocol_params_t *params, double *tau, double *prob, int count)
+{
+    struct probe pr[KARY_MAX];
+    int i, pending;
+
+    if (count > 1) {
+        pthread_mutex_lock(&pool->mutex);
+        for (i = count - 1; i > 0; i--) {
+            pr[i].pc = *params;
+            pr[i].pc.tau = tau[i];
+            pr[i].slot = slot;
+            pr[i].done = 0;
+            pr[i].next = pool->probes;
+            pool->probes = &pr[i];
+        }
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    params->tau = tau[0];
+    SET_ON(params);
+    SET_ACTIVE(params);
+    prob[0] = contact_union(slot, params);
+
+    if (count == 1)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        for (pending = 0, i = 1; i < count; i++)
+            pending += !pr[i].done;
+        if (pending == 0)
+            break;
+        if (pool->probes != NULL)
+            run_probe(pool, take_probe(pool));
+        else
+            pthread_cond_wait(&pool->assist, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 1; i < count; i++)
+        prob[i] = pr[i].prob;
+}
+
+
+static double probe_tau(int slot, protocol_params_t *params, double tau)
+{
+    params->tau = tau;
+    SET_ON(params);
+    SET_ACTIVE(params);
+    return contact_union(slot, params);
+}
+
+
+/*
+ * Narrows [lb, ub] to a bracket around guess, checking that its lower end
+ * is infeasible and its upper end feasible. If the upper end fails, the
+ * bracket falls back to ub; if the lower end does, it moves down, doubling
+ * its width, until it reaches lb. f receives prob - prob_bound at both 
+ * ends.
+ */
+static int warm_bracket(double prob_bound, double *lb, double *ub, 
+        double guess, int slot, protocol_params_t *params, double *f)
+{
+    double width = WARM_WIDTH * guess;
+    double lo = guess - width > *lb ? guess - width : *lb;
+    double hi = guess + width < *ub ? guess + width : *ub;
+
+    f[0] = probe_tau(slot, params, hi) - prob_bound;
+    if (f[0] < 0) {
+        if (hi == *ub)
+            return NO_SOLUTION;
+        f[1] = probe_tau(slot, params, *ub) - prob_bound;
+        if (f[1] < 0)
+            return NO_SOLUTION;
+        *lb = hi;
+        return BRACKETED;
+    }
+    *ub = hi;
+    f[1] = f[0];
+
+    while ((f[0] = probe_tau(slot, params, lo) - prob_bound) >= 0) {
+        if (lo == *lb)
+            return TRIVIAL;
+        *ub = lo;
+        f[1] = f[0];
+        width *= 2;
+        lo = lo - width > *lb ? lo - width : *lb;
+    }
+    *lb = lo;
+    return BRACKETED;
+}
+
+
+/*
+ * Solves contact_union(slot, tau) = prob_bound for the lowest feasible tau
+ * by the root finder, until the energy left to save in the bracket is 
+ * within BRACKET_TOL. incumbent is the best energy any worker has found so 
+ * far; the search is abandoned once the energy at lb, a bound for all taus
+ * left, exceeds it. Given a pool, each round also evaluates, evenly spread
+ * over the bracket, as many taus as there are idle workers. A guess other 
+ * than 0 starts from a warm bracket around it.
+ */
 static int find_optimal(double prob_bound, double lb, double ub, double T, 
-        int slot, protocol_params_t *params, double *energy)
+        int slot, protocol_params_t *params, double *energy, 
+        double *incumbent, struct worker_pool *pool, double guess)
 {
     unsigned long calls;
-    double middle = (ub - lb) / 2 + lb;
-    double last_energy, new_energy = DBL_MAX;
+    double tau[KARY_MAX], prob[KARY_MAX], f[2];
+    double lb_energy, ub_energy;
+    int i, count, res;
+    rootfind_t rf;
     
     assert(energy != NULL);
     assert(params != NULL);
     
     *energy = DBL_MAX;
+    if (energy_per_time(lb, params->lambda, params->samples) > 
+            load_energy(incumbent))
+        return PRUNED;
+
+    if (guess > 0) {
+        res = warm_bracket(prob_bound, &lb, &ub, guess, slot, params, f);
+        if (res == TRIVIAL)
+            *energy = energy_per_time(ub, params->lambda, params->samples);
+        if (res != BRACKETED)
+            return res;
+    } else {
+        f[1] = probe_tau(slot, params, ub) - prob_bound;
+        if (f[1] < 0)
+            return NO_SOLUTION;
+
+        f[0] = probe_tau(slot, params, lb) - prob_bound;
+        if (f[0] >= 0) {
+            *energy = energy_per_time(ub, params->lambda, params->samples);
+            return TRIVIAL;
+        }
+    }
 
-    params->tau = ub;
-    SET_ON(params);
-    SET_ACTIVE(params);
+    // energy grows linearly with tau, by (Itx - Ioff) / 2 pi
+    rootfind_init(&rf, lb, ub, f[0], f[1], BRACKET_TOL / 2 * 
+            energy_per_time(lb, params->lambda, params->samples) * 
+            2 * M_PI / (Itx - Ioff));
 
-    if (contact_union(slot, params) < prob_bound)
-        return NO_SOLUTION;
-    last_energy = energy_per_time(params->tau, params->lambda, params->samples);
+    res = MAXCALL_REACHED;
+    for (calls = 0; calls < MAX_CALLS; calls++) {
+        lb_energy = energy_per_time(rf.a, params->lambda, params->samples);
+        ub_energy = energy_per_time(rf.b, params->lambda, params->samples);
+        if ((ub_energy - lb_energy) / ub_energy < BRACKET_TOL) {
+            res = TOL_REACHED;
+            break;
+        }
+        if (lb_energy > load_energy(incumbent) || solver_expired(context()))
+            return PRUNED;
 
-    params->tau = lb; 
+        count = probe_width(pool);
+        tau[0] = rootfind_next(&rf);
+        for (i = 1; i < count; i++)
+            tau[i] = (rf.b - rf.a) * i / count + rf.a;
+        probe_taus(pool, slot, params, tau, prob, count);
+
+        for (i = 0; i < count; i++)
+            rootfind_update(&rf, tau[i], prob[i] - prob_bound);
+    }
+
+    params->tau = rf.b;
     SET_ON(params);
     SET_ACTIVE(params);
-    
-    if (contact_union(slot, params) > prob_bound) {
-        *energy = last_energy;
-        return TRIVIAL;
-    }
+    *energy = energy_per_time(rf.b, params->lambda, params->samples);
+    return res;
+}
 
-    for (calls = 0; calls < MAX_CALLS; calls++) {
-        double prob;
-        
-        params->tau = middle;
-        SET_ON(params);
-        SET_ACTIVE(params);
-        
-        prob = contact_union(slot, params);
 
-        if (prob >= prob_bound) { 
-            double delta;
-            
-            new_energy = energy_per_time(params->tau, params->lambda, 
-                    params->samples);
-            delta = fabs(new_energy - last_energy);
-            if (delta / last_energy < TOL_REL) {
-                *energy = new_energy;
-                return TOL_REACHED;
-            }
-            last_energy = new_energy;
+unsigned long time_delta(struct timeval *start, struct timeval *end)
+{
+    double t1, t2;
+
+    t1 = (double) start->tv_sec * 1000 + (double) start->tv_usec / 1000;
+    t2 = (double) end->tv_sec * 1000 + (double) end->tv_usec / 1000;
+    return t2 - t1;
+}
+
+
+static int pop_task(struct task_deque *d, int head, struct worker_task *task)
+{
+    int found = 0;
 
-            ub = middle;
+    pthread_mutex_lock(&d->mutex);
+    if (d->head < d->tail) {
+        *task = head ? d->task[d->head++] : d->task[--d->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return found;
+}
+
+
+// Returns the deque whose head has the lowest bound, -1 if all are empty.
+static int best_deque(struct worker_pool *pool)
+{
+    struct task_deque *d;
+    double bound = DBL_MAX;
+    int i, best = -1;
+
+    for (i = 0; i < pool->size; i++) {
+        d = &pool->deque[i];
+        pthread_mutex_lock(&d->mutex);
+        if (d->head < d->tail && 
+                (best < 0 || d->task[d->head].bound < bound)) {
+            bound = d->task[d->head].bound;
+            best = i;
         }
-        else 
-            lb = middle;
-        
-        middle = (ub - lb) / 2 + lb;
+        pthread_mutex_unlock(&d->mutex);
     }
-    *energy = new_energy;
-    return MAXCALL_REACHED;
+    return best;
 }
 
 
-static void *worker_thread(void *data)
+static int take_task(struct worker_pool *pool, int id, 
+        struct worker_task *task)
 {
-    int res;
-    struct worker_data *wd = (struct worker_data *) data;
-    struct worker_task task;
-    double energy;
-    int thread_id;
-    
-    pthread_mutex_lock(wd->task_mutex);
-    thread_cnt++;
-    thread_id = thread_cnt;
-    pthread_mutex_unlock(wd->task_mutex);
+    int i;
 
-    pthread_sem_up(1, wd->sem_worker_available);
-    printf("[%d] online\n", thread_id);
-    
-    while (!*wd->finish) {
-        pthread_mutex_lock(wd->task_mutex);
-        pthread_sem_down(1, wd->sem_new_task, wd->task_mutex); 
+    if (pop_task(&pool->deque[id], 1, task))
+        return 1;
 
-        if (*wd->finish) {
-            pthread_mutex_unlock(wd->task_mutex);
-            break;
-        }
+    if (__atomic_load_n(&pool->best_first, __ATOMIC_RELAXED)) {
+        while ((i = best_deque(pool)) >= 0)
+            if (pop_task(&pool->deque[i], 1, task))
+                return 1;
+        return 0;
+    }
 
-        memcpy(&task, wd->task, sizeof(struct worker_task));
+    for (i = 1; i < pool->size; i++)
+        if (pop_task(&pool->deque[(id + i) % pool->size], 0, task))
+            return 1;
+    return 0;
+}
 
-        pthread_sem_up(1, wd->sem_task_buffered);
-        pthread_mutex_unlock(wd->task_mutex);
 
-        res = find_optimal(wd->probability, task.lb, task.ub, task.T, task.slot,
-                &task.pc, &energy);
+static struct solved_tau *tau_find(struct tau_table *t, int slot, 
+        int samples)
+{
+    size_t i = ((unsigned int) slot * 2654435761u + samples) & t->mask;
+
+    while (t->entry[i].samples != 0 && (t->entry[i].slot != slot || 
+                t->entry[i].samples != samples))
+        i = (i + 1) & t->mask;
+    return &t->entry[i];
+}
 
-        if (res == NO_SOLUTION) {
-            printf("[%d] finished %dx%.2fms samples=%d no solution\n", 
-                    thread_id, task.slot + 1, task.T / 100, task.pc.samples); 
-            pthread_sem_up(1, wd->sem_worker_available);
-            continue;
-        }
-        
-        printf("[%d] finished %dx%.2fms samples=%d tau=%.2fms I=%.2f "
-                "(mA * 100)\n", thread_id, task.slot + 1, task.T / 100, 
-                task.pc.samples, task.pc.tau * task.T / 100 / 2 / M_PI, energy); 
-        pthread_mutex_lock(wd->task_mutex);
-
-        if (energy < *wd->energy) {
-            if (wd->slots != NULL) {
-                if (*wd->period != DBL_MAX && 
-                        (task.slot + 1) * task.T > *wd->period * *wd->slots) {
-                    pthread_sem_up(1, wd->sem_worker_available);
-                    pthread_mutex_unlock(wd->task_mutex);
-                    continue;
-                }
-                *wd->slots = task.slot + 1;
-            } else
-                *wd->energy = energy;
-            
-            memcpy(wd->params, &task.pc, sizeof(protocol_params_t));
-            *wd->period = task.T;
-        }
 
-        pthread_sem_up(1, wd->sem_worker_available);
-        pthread_mutex_unlock(wd->task_mutex);
+static void tau_put(struct tau_table *t, struct worker_task *task)
+{
+    int slot = task->slot, samples = task->pc.samples;
+    struct solved_tau *old = t->entry, *e;
+    size_t i, size = t->mask + 1;
+
+    pthread_mutex_lock(&t->mutex);
+    if (old == NULL || 2 * (t->used + 1) > size) {
+        size = old == NULL ? 256 : 2 * size;
+        t->entry = calloc(size, sizeof(struct solved_tau));
+        t->mask = size - 1;
+        for (i = 0; old != NULL && i < size / 2; i++)
+            if (old[i].samples != 0)
+                *tau_find(t, old[i].slot, old[i].samples) = old[i];
+        free(old);
     }
-    printf("[%d] offline\n", thread_id);
-    return NULL;
+
+    e = tau_find(t, slot, samples);
+    if (e->samples == 0)
+        t->used++;
+    e->slot = slot;
+    e->samples = samples;
+    e->at = (task->pc.tau - task->lb) / (task->ub - task->lb);
+    pthread_mutex_unlock(&t->mutex);
 }
 
 
-unsigned long time_delta(struct timeval *start, struct timeval *end)
+/*
+ * Predicts tau at the same fraction of the bracket as for the nearest 
+ * solved neighbour, 0 if there is none.
+ */
+static double tau_guess(struct tau_table *t, struct worker_task *task)
 {
-    double t1, t2;
+    int slot = task->slot, samples = task->pc.samples;
+    static const int near[][2] = {{0, -1}, {-1, 0}, {0, 1}, {1, 0}};
+    struct solved_tau *e;
+    double tau = 0;
+    int i;
 
-    t1 = (double) start->tv_sec * 1000 + (double) start->tv_usec / 1000;
-    t2 = (double) end->tv_sec * 1000 + (double) end->tv_usec / 1000;
-    return t2 - t1;
+    pthread_mutex_lock(&t->mutex);
+    for (i = 0; t->entry != NULL && tau == 0 && i < 4; i++) {
+        e = tau_find(t, slot + near[i][0], samples + near[i][1]);
+        if (e->samples != 0)
+            tau = task->lb + e->at * (task->ub - task->lb);
+    }
+    pthread_mutex_unlock(&t->mutex);
+    return tau;
+}
+
+
+static void tau_clear(struct tau_table *t)
+{
+    free(t->entry);
+    t->entry = NULL;
+    t->mask = 0;
+    t->used = 0;
+}
+
+
+void solver_set_deadline(struct context *ctx, const struct timeval *tv)
+{
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->has_deadline = tv != NULL;
+    if (tv != NULL)
+        ctx->deadline = *tv;
+    __atomic_store_n(&ctx->expired, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ctx->mutex);
 }
 
 
-double get_latency_params(double latency, double probability, double *period, 
-        protocol_params_t *params)
+int solver_expired(struct context *ctx)
 {
-    struct timeval start, end;
-    struct timezone tz;
-    unsigned long total_states = 0, states_completed = 0;
+    struct timeval now;
+
+    if (__atomic_load_n(&ctx->expired, __ATOMIC_RELAXED))
+        return 1;
+    if (!ctx->has_deadline)
+        return 0;
+
+    gettimeofday(&now, NULL);
+    if (!timercmp(&now, &ctx->deadline, >))
+        return 0;
+    __atomic_store_n(&ctx->expired, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+/*
+ * In the lifetime search any solution will do, so the first one in sweep 
+ * order is kept and the tasks after it are skipped.
+ */
+static int task_pruned(struct worker_data *wd, struct worker_task *task)
+{
+    if (solver_expired(context()))
+        return 1;
+    if (wd->slots != NULL)
+        return *wd->slots > 0 && task->order > wd->found;
+    return task->bound > *wd->energy;
+}
+
+
+static void run_task(struct worker_data *wd, int thread_id, 
+        struct worker_task *task)
+{
+    solver_settings_t *settings = &context()->solver;
+    int res, pruned;
+    double energy;
+    struct timeval end;
     unsigned long elapsed, estimated;
 
-    int i, j, max_slots, max_samples;
-    double min_energy = DBL_MAX;
-    double lambda;
-    pthread_t *threads;
-    int thread_num = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_mutex_lock(&wd->result_mutex);
+    pruned = task_pruned(wd, task);
+    pthread_mutex_unlock(&wd->result_mutex);
+
+    if (pruned)
+        res = PRUNED;
+    else {
+        memo_task_begin();
+        res = find_optimal(wd->probability, task->lb, task->ub, task->T, 
+                task->slot, &task->pc, &energy, wd->energy, 
+                settings->kary ? wd->pool : NULL, settings->warm ? 
+                tau_guess(&wd->taus, task) : 0);
+        if (settings->warm && res > TRIVIAL)
+            tau_put(&wd->taus, task);
+
+        if (res == PRUNED)
+            report("[%d] pruned %dx%.2fms samples=%d\n", thread_id, 
+                    task->slot + 1, task->T / 100, task->pc.samples); 
+        else if (res == NO_SOLUTION)
+            report("[%d] finished %dx%.2fms samples=%d no solution\n", 
+                    thread_id, task->slot + 1, task->T / 100, 
+                    task->pc.samples); 
+        else
+            report("[%d] finished %dx%.2fms samples=%d tau=%.2fms I=%.2f "
+                    "(mA * 100)\n", thread_id, task->slot + 1, task->T / 100, 
+                    task->pc.samples, task->pc.tau * task->T / 100 / 2 / M_PI,
+                    energy); 
+    }
 
-    int finish = 0;
-    
-    pthread_sem_t sem_worker_available;
-    pthread_sem_t sem_new_task;
-    pthread_sem_t sem_task_buffered;
-    pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&wd->result_mutex);
+    if (res >= 0 && energy < *wd->energy && 
+            !task_pruned(wd, task)) {
+        if (wd->slots != NULL) {
+            *wd->slots = task->slot + 1;
+            wd->found = task->order;
+        } else
+            __atomic_store(wd->energy, &energy, __ATOMIC_RELAXED);
+
+        memcpy(wd->params, &task->pc, sizeof(protocol_params_t));
+        *wd->period = task->T;
+    }
 
+    if (wd->slots == NULL) {
+        wd->states_completed++;
+        gettimeofday(&end, NULL);
+        elapsed = time_delta(&wd->start, &end);
+        estimated = elapsed * wd->total_states / wd->states_completed;
+        report("exploring at %6.2f%% remaining %lds\n", 
+                wd->states_completed * 100. / wd->total_states,
+                (estimated - elapsed) / 1000);
+    }
+    pthread_mutex_unlock(&wd->result_mutex);
+}
+
+
+// Runs the tasks left in the deques.
+static void run_tasks(struct worker_pool *pool, int id)
+{
     struct worker_task task;
-    struct worker_data worker_data = {
-        .probability = probability,
-        .task = &task,
-        
-        .finish = &finish,
-        
-        .energy = &min_energy,
-        .slots = NULL,
-        .params = params,
-        .period = period,
+    struct worker_data *wd;
+
+    while (take_task(pool, id, &task)) {
+        wd = task.wd;
+        __atomic_add_fetch(&pool->working, 1, __ATOMIC_RELAXED);
+        run_task(wd, id + 1, &task);
+        __atomic_sub_fetch(&pool->working, 1, __ATOMIC_RELAXED);
+
+        // the call may return, and wd go, as soon as the mutex is released
+        pthread_mutex_lock(&pool->mutex);
+        if (--wd->pending == 0)
+            pthread_cond_signal(&wd->done);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
 
-        .sem_new_task = &sem_new_task,
-        .sem_task_buffered = &sem_task_buffered,
-        .sem_worker_available = &sem_worker_available,
-        .task_mutex = &task_mutex,
-    };
 
-    assert(period != NULL);
-    assert(params != NULL);
+static void *worker_thread(void *data)
+{
+    struct worker_pool *pool = (struct worker_pool *) data;
+    unsigned int posted;
+    int id;
     
-    pthread_sem_init(0, &sem_worker_available);
-    pthread_sem_init(0, &sem_new_task);
-    pthread_sem_init(0, &sem_task_buffered);
+    context_enter(pool->ctx);
+    pthread_mutex_lock(&pool->mutex);
+    id = pool->online++;
+    pthread_mutex_unlock(&pool->mutex);
 
-    latency *= 100;
-    max_slots = latency / 2 / (2 * MINttx + trx);
+    report("[%d] online\n", id + 1);
+    
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->finish) {
+        if (pool->probes != NULL) {
+            run_probe(pool, take_probe(pool));
+            continue;
+        }
 
-    printf("running on %d threads\n", thread_num);
-    threads = malloc(thread_num * sizeof(pthread_t));
-    for (i = 0; i < thread_num; i++)
-        pthread_create(threads + i, NULL, worker_thread, &worker_data);
+        posted = pool->posted;
+        pthread_mutex_unlock(&pool->mutex);
+        run_tasks(pool, id);
+        pthread_mutex_lock(&pool->mutex);
 
+        while (pool->posted == posted && pool->probes == NULL && 
+                !pool->finish)
+            pthread_cond_wait(&pool->work, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    report("[%d] offline\n", id + 1);
+    memo_thread_exit();
+    contact_union_free();
+    context_enter(NULL);
+    return NULL;
+}
 
-    for (i = 0; i < max_slots; i++) {
-        task.slot = i;
-        task.T = latency / (i + 1);
-        lambda = get_lambda(task.T);
-        task.lb = 2 * lambda;
 
-        if (2 * M_PI * MINttx / task.T > task.lb)
-            task.lb = 2 * M_PI * MINttx / task.T;
+static void pool_start(struct worker_pool *pool, context_t *ctx, int size)
+{
+    int i, count, *cpu;
+
+    pool->ctx = ctx;
+    pool->size = size;
+    pool->online = 0;
+    pool->posted = 0;
+    pool->finish = 0;
+    pool->best_first = 0;
+    pool->probes = NULL;
+    pool->working = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->assist, NULL);
+
+    pool->deque = calloc(size, sizeof(struct task_deque));
+    for (i = 0; i < size; i++)
+        pthread_mutex_init(&pool->deque[i].mutex, NULL);
+
+    pool->threads = malloc(size * sizeof(pthread_t));
+    for (i = 0; i < size; i++)
+        pthread_create(pool->threads + i, NULL, worker_thread, pool);
+
+    // the values a worker computes stay in the caches of its CPU
+    if (!ctx->solver.pin)
+        return;
+    cpu = malloc(CPUS_MAX * sizeof(int));
+    count = cpus_list(cpu, CPUS_MAX);
+    for (i = 0; i < size && count > 0; i++)
+        if (cpus_pin(pool->threads[i], cpu[i % count]) == 0)
+            report("[%d] pinned to cpu %d\n", i + 1, cpu[i % count]);
+    free(cpu);
+}
+
 
-        total_states += (M_PI - lambda) / task.lb - 1;
+/*
+ * Deals the tasks of wd round robin to the workers, in sweep order, and 
+ * returns once all have been run. The deques are empty, since the calls 
+ * on a pool take turns, but workers may still be looking into them.
+ */
+static void pool_run(struct worker_pool *pool, struct worker_data *wd,
+        struct worker_task *tasks, int count)
+{
+    struct task_deque *d;
+    int i, j, share = count / pool->size + 1;
+
+    if (count == 0)
+        return;
+    wd->pending = count;
+
+    for (i = 0; i < pool->size; i++) {
+        d = &pool->deque[i];
+        pthread_mutex_lock(&d->mutex);
+        if (d->size < share) {
+            d->size = share;
+            d->task = realloc(d->task, share * sizeof(*tasks));
+            assert(d->task != NULL);
+        }
+        d->head = d->tail = 0;
+        for (j = i; j < count; j += pool->size)
+            d->task[d->tail++] = tasks[j];
+        pthread_mutex_unlock(&d->mutex);
     }
 
+    pthread_mutex_lock(&pool->mutex);
+    pool->posted++;
+    pthread_cond_broadcast(&pool->work);
+    while (wd->pending > 0)
+        pthread_cond_wait(&wd->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
 
-    gettimeofday(&start, &tz);
-    pthread_mutex_lock(&task_mutex);
-    pthread_sem_down(1, &sem_worker_available, &task_mutex);
-    
-    for (i = 0; i < max_slots; i++) {
-        task.slot = i;
-        task.T = latency / (i + 1);
-        lambda = get_lambda(task.T);
-        task.lb = 2 * lambda;
+static void pool_stop(struct worker_pool *pool)
+{
+    int i;
 
-        if (2 * M_PI * MINttx / task.T > task.lb)
-            task.lb = 2 * M_PI * MINttx / task.T;
+    pthread_mutex_lock(&pool->mutex);
+    pool->finish = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
 
-        max_samples = (M_PI - lambda) / task.lb - 1;
+    report("waiting for all workers\n");
+    for (i = 0; i < pool->size; i++)
+        pthread_join(pool->threads[i], NULL);
 
-        if (energy_per_time(task.lb, lambda, 1) > min_energy) {
-            printf("stopping at %d periods, as min(Itx)=%.2f mA * 100 from "
-                    "now\n", i + 1, energy_per_time(task.lb, lambda, 1));
+    for (i = 0; i < pool->size; i++) {
+        pthread_mutex_destroy(&pool->deque[i].mutex);
+        free(pool->deque[i].task);
+    }
+    free(pool->deque);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->assist);
+}
+
+
+// Called with the context bound and its mutex held.
+static struct worker_pool *get_workers(context_t *ctx)
+{
+    if (ctx->workers == NULL) {
+        ctx->workers = calloc(1, sizeof(struct worker_pool));
+        assert(ctx->workers != NULL);
+        pool_start(ctx->workers, ctx, ctx->solver.threads > 0 ? 
+                ctx->solver.threads : cpus_available());
+        report("running on %d threads\n", ctx->workers->size);
+    }
+    return ctx->workers;
+}
+
+
+void solver_shutdown(struct context *ctx)
+{
+    if (ctx->workers == NULL)
+        return;
+    pool_stop(ctx->workers);
+    free(ctx->workers);
+    ctx->workers = NULL;
+}
+
+
+static int max_samples(struct worker_task *task)
+{
+    return (M_PI - task->pc.lambda) / task->lb - 1;
+}
+
+
+static void init_slot(struct worker_task *task, double latency, int slot)
+{
+    task->slot = slot;
+    task->T = latency / (slot + 1);
+    task->pc.lambda = get_lambda(task->T);
+    task->lb = 2 * task->pc.lambda;
+
+    if (2 * M_PI * MINttx / task->T > task->lb)
+        task->lb = 2 * M_PI * MINttx / task->T;
+}
+
+
+/*
+ * Lists the (slot, samples) tasks of the next slots, at least min_count of
+ * them unless the sweep ends first. The sweep ends where even the lowest 
+ * energy of a slot exceeds the best one so far.
+ */
+static int sweep_tasks(struct worker_data *wd, struct task_sweep *sw, 
+        int min_count)
+{
+    struct worker_task task = {
+        .wd = wd
+    };
+    double lambda;
+    int j, samples, count = 0;
+
+    for (; sw->slot < sw->max_slots && count < min_count; sw->slot++) {
+        init_slot(&task, sw->latency, sw->slot);
+        lambda = task.pc.lambda;
+        samples = max_samples(&task);
+
+        if (energy_per_time(task.lb, lambda, 1) > *wd->energy) {
+            report("stopping at %d periods, as min(Itx)=%.2f mA * 100 "
+                    "from now\n", sw->slot + 1, 
+                    energy_per_time(task.lb, lambda, 1));
+            sw->slot = sw->max_slots;
             break;
         }
 
-        for (j = 1; j <= max_samples; j++) {
+        for (j = 1; j <= samples; j++) {
             task.ub = (M_PI - lambda) / (j + 1);
-            task.pc.lambda = lambda;
             task.pc.samples = j;
+            task.bound = energy_per_time(task.lb, lambda, j);
 
-            if (energy_per_time(task.lb, lambda, j) > min_energy) {
-                states_completed += max_samples - j + 1;
-                printf("stopping samples at %d, as min(I)=%.2f mA * 100 from "
-                        "now\n", j, energy_per_time(task.lb, lambda, j));
+            if (task.bound > *wd->energy) {
+                wd->states_completed += samples - j + 1;
+                report("stopping samples at %d, as min(I)=%.2f mA * 100 "
+                        "from now\n", j, energy_per_time(task.lb, lambda, j));
                 break;
             }
 
-            pthread_sem_up(1, &sem_new_task);
-            pthread_sem_down(1, &sem_task_buffered, &task_mutex);
-            pthread_sem_down(1, &sem_worker_available, &task_mutex);
-            
-            states_completed++;
-            gettimeofday(&end, &tz);
-            elapsed = time_delta(&start, &end);
-            estimated = elapsed * total_states / states_completed;
-            printf("exploring at %6.2f%% remaining %lds\n", 
-                    states_completed * 100. / total_states,
-                    (estimated - elapsed) / 1000);
+            if (count == sw->size) {
+                sw->size = sw->size ? 2 * sw->size : 256;
+                sw->tasks = realloc(sw->tasks, sw->size * sizeof(task));
+            }
+            task.order = sw->order++;
+            sw->tasks[count++] = task;
         }
     }
-    pthread_mutex_unlock(&task_mutex);
-    gettimeofday(&end, &tz);
-    elapsed = time_delta(&start, &end);
-
-    finish = 1;
-    pthread_mutex_lock(&task_mutex);
-    pthread_sem_up(thread_num, &sem_new_task);
-    pthread_mutex_unlock(&task_mutex);
-
-    printf("waiting for all workers\n");
-    for (i = 0; i < thread_num; i++)
-        pthread_join(threads[i], NULL);
-    
-    printf("\nexplored a total of %ld states in %ld.%lds\n\n", total_states,
-            elapsed / 1000, elapsed % 1000);
-    
-    free(threads);
-    return min_energy;
+    return count;
 }
 
 
-static double try_latency(int thread_num, double latency, double max_energy, 
-        double probability, struct worker_data *wd)
+static int compare_bound(const void *a, const void *b)
 {
-    int i, j, max_slots, max_samples;
-    double lambda;
-    struct worker_task *task = wd->task;
-
-    printf("trying latency %.2f ms\n", latency / 100);
-    max_slots = latency / 2 / (2 * MINttx + trx);
-    
-    *wd->period = DBL_MAX;
-    *wd->slots = 0;
+    const struct worker_task *ta = a, *tb = b;
 
-    pthread_mutex_lock(wd->task_mutex);
-    pthread_sem_down(1, wd->sem_worker_available, wd->task_mutex);
-    
-    for (i = 0; i < max_slots; i++) {
-        task->slot = i;
-        task->T = latency / (i + 1);
-        lambda = get_lambda(task->T);
-        task->lb = 2 * lambda;
+    if (ta->bound != tb->bound)
+        return ta->bound < tb->bound ? -1 : 1;
+    return ta->order - tb->order;
+}
 
-        if (2 * M_PI * MINttx / task->T > task->lb)
-            task->lb = 2 * M_PI * MINttx / task->T;
 
-        max_samples = (M_PI - lambda) / task->lb - 1;
+/*
+ * Runs the sweep of a latency in batches of whole slots, so that the bound
+ * is checked again between batches; the lifetime search stops at the first
+ * batch with a solution. Best first, all tasks go in one batch sorted by
+ * their bound and dealt round robin, so that every deque is sorted as well
+ * and the first solutions found are the most promising.
+ */
+static void sweep_latency(struct worker_data *wd, double latency)
+{
+    struct task_sweep sw = {
+        .latency = latency,
+        .max_slots = latency / 2 / (2 * MINttx + trx),
+    };
+    struct worker_pool *pool = wd->pool;
+    int count;
+
+    tau_clear(&wd->taus);
+    if (wd->slots == NULL && context()->solver.best_first) {
+        count = sweep_tasks(wd, &sw, INT_MAX);
+        qsort(sw.tasks, count, sizeof(struct worker_task), compare_bound);
+        __atomic_store_n(&pool->best_first, 1, __ATOMIC_RELAXED);
+        pool_run(pool, wd, sw.tasks, count);
+        __atomic_store_n(&pool->best_first, 0, __ATOMIC_RELAXED);
+        free(sw.tasks);
+        return;
+    }
 
-        if (energy_per_time(task->lb, lambda, 1) > max_energy) {
-            printf("stopping at %d periods, as min(Itx)=%.2f mA * 100 "
-                    "from now\n", i + 1, energy_per_time(task->lb, lambda, 1));
+    while ((count = sweep_tasks(wd, &sw, SWEEP_BATCH * pool->size)) > 0) {
+        pool_run(pool, wd, sw.tasks, count);
+        if ((wd->slots != NULL && *wd->slots > 0) || 
+                solver_expired(context()))
             break;
-        }
+    }
+    free(sw.tasks);
+}
 
-        if (*wd->slots > 0) 
-            break;
 
-        for (j = 1; j <= max_samples; j++) {
-            task->ub = (M_PI - lambda) / (j + 1);
-            task->pc.lambda = lambda;
-            task->pc.samples = j;
+double get_latency_params(struct context *ctx, double latency, 
+        double probability, double *period, protocol_params_t *params)
+{
+    context_t *outer;
+    struct timeval end;
+    struct worker_task task;
+    unsigned long elapsed;
+    int i, max_slots;
+    double min_energy = DBL_MAX;
 
-            if (energy_per_time(task->lb, lambda, j) > max_energy) {
-                printf("stopping samples at %d, as min(I)=%.2f from now\n", j, 
-                        energy_per_time(task->lb, lambda, j));
-                break;
-            }
-            if (*wd->slots > 0) 
-                break;
+    struct worker_data worker_data = {
+        .probability = probability,
+        
+        .energy = &min_energy,
+        .slots = NULL,
+        .params = params,
+        .period = period,
 
-            pthread_sem_up(1, wd->sem_new_task);
-            pthread_sem_down(1, wd->sem_task_buffered, wd->task_mutex);
-            pthread_sem_down(1, wd->sem_worker_available, wd->task_mutex);
-        }
+        .taus.mutex = PTHREAD_MUTEX_INITIALIZER,
+        .result_mutex = PTHREAD_MUTEX_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+    };
+
+    assert(period != NULL);
+    assert(params != NULL);
+
+    latency *= 100;
+    max_slots = latency / 2 / (2 * MINttx + trx);
+
+    pthread_mutex_lock(&ctx->mutex);
+    outer = context_enter(ctx);
+    worker_data.pool = get_workers(ctx);
+
+    for (i = 0; i < max_slots; i++) {
+        init_slot(&task, latency, i);
+        worker_data.total_states += max_samples(&task);
     }
-    pthread_sem_down(thread_num - 1, wd->sem_worker_available, wd->task_mutex);
-    pthread_sem_up(thread_num, wd->sem_worker_available);
-    pthread_mutex_unlock(wd->task_mutex);
+
+    gettimeofday(&worker_data.start, NULL);
+    sweep_latency(&worker_data, latency);
+    gettimeofday(&end, NULL);
+    elapsed = time_delta(&worker_data.start, &end);
+
+    tau_clear(&worker_data.taus);
+    
+    report("\nexplored a total of %ld states in %ld.%lds\n\n", 
+            worker_data.total_states, elapsed / 1000, elapsed % 1000);
+    context_enter(outer);
+    pthread_mutex_unlock(&ctx->mutex);
+    
+    return min_energy;
+}
+
+
+static double try_latency(double latency, struct worker_data *wd)
+{
+    report("trying latency %.2f ms\n", latency / 100);
+    
+    *wd->period = DBL_MAX;
+    *wd->slots = 0;
+
+    sweep_latency(wd, latency);
 
     return *wd->slots * *wd->period;
 }
 
 
-double get_lifetime_params(double lifetime, double probability, double *period,
-        protocol_params_t *params)
+double get_lifetime_params(struct context *ctx, double lifetime, 
+        double probability, double *period, protocol_params_t *params)
 {
+    context_t *outer;
     double lb, ub, middle;
     double last_latency, actual_latency;
+    double best_latency = DBL_MAX, best_period = DBL_MAX;
+    protocol_params_t best_params;
     unsigned long calls;
+    rootfind_t rf;
     double max_energy = BATTERY / lifetime;
-    int thread_num = sysconf(_SC_NPROCESSORS_ONLN);
-
-    pthread_t *threads;
-    pthread_sem_t sem_worker_available;
-    pthread_sem_t sem_new_task;
-    pthread_sem_t sem_task_buffered;
-    pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
-    int finish = 0;
     int slots = 0;
-    int i;
 
-    struct worker_task task;
     struct worker_data worker_data = {
         .probability = probability,
-        .task = &task,
-        
-        .finish = &finish,
         
         .energy = &max_energy,
         .slots = &slots,
         .params = params,
         .period = period,
 
-        .sem_new_task = &sem_new_task,
-        .sem_task_buffered = &sem_task_buffered,
-        .sem_worker_available = &sem_worker_available,
-        .task_mutex = &task_mutex,
+        .taus.mutex = PTHREAD_MUTEX_INITIALIZER,
+        .result_mutex = PTHREAD_MUTEX_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
     };
 
     assert(period != NULL);
     assert(params != NULL);
 
-    pthread_sem_init(0, &sem_worker_available);
-    pthread_sem_init(0, &sem_new_task);
-    pthread_sem_init(0, &sem_task_buffered);
-
-    threads = malloc(thread_num * sizeof(pthread_t));
-    for (i = 0; i < thread_num; i++)
-        pthread_create(threads + i, NULL, worker_thread, &worker_data);
+    pthread_mutex_lock(&ctx->mutex);
+    outer = context_enter(ctx);
+    worker_data.pool = get_workers(ctx);
 
     lb = 4 * MINttx;
     ub = MAXLATENCY;
-    middle = (ub - lb) / 2 + lb;
  
     last_latency = ub;
-    actual_latency = try_latency(thread_num, last_latency, max_energy, 
-            probability, &worker_data);
-
-    if (actual_latency == 0) {
-        actual_latency = DBL_MAX;
+    actual_latency = try_latency(last_latency, &worker_data);
+    if (actual_latency == 0)
         goto lifetime_terminate;
-    }
-
-    for (calls = 0; calls < MAX_CALLS * 100; calls++) {
-        actual_latency = try_latency(thread_num, middle, max_energy, 
-                probability, &worker_data);
+    best_latency = actual_latency;
+    best_period = *period;
+    best_params = *params;
+
+    // only whether a latency can be met is known, so the steps bisect
+    rootfind_init(&rf, lb, ub, -1, 1, TOL_REL * lb);
+    for (calls = 0; calls < MAX_CALLS * 100 && !solver_expired(ctx); 
+            calls++) {
+        middle = rootfind_next(&rf);
+        actual_latency = try_latency(middle, &worker_data);
+        rootfind_update(&rf, middle, actual_latency != 0 ? 1 : -1);
 
         if (actual_latency != 0) {
             double delta;
 
+            if (actual_latency < best_latency) {
+                best_latency = actual_latency;
+                best_period = *period;
+                best_params = *params;
+            }
             delta = fabs(middle - last_latency);
             if (delta / last_latency < TOL_REL) {
                 break;
             }
-            last_latency = ub = middle;
-        } else 
-            lb = middle;
-
-        middle = (ub - lb) / 2 + lb;
+            last_latency = middle;
+        }
     }
 
 lifetime_terminate:
-    finish = 1;
-    pthread_mutex_lock(&task_mutex);
-    pthread_sem_up(thread_num, &sem_new_task);
-    pthread_mutex_unlock(&task_mutex);
-
-    printf("waiting for all workers\n");
-    for (i = 0; i < thread_num; i++)
-        pthread_join(threads[i], NULL);
-    
-    free(threads);
+    // the last try may have failed or expired; the best one found stands
+    *period = best_period;
+    if (best_latency != DBL_MAX)
+        *params = best_params;
 
-    return actual_latency;
-}
+    tau_clear(&worker_data.taus);
+    context_enter(outer);
+    pthread_mutex_unlock(&ctx->mutex);
 
+    return best_latency;
+}
@@ -20,15 +20,43 @@
 #ifndef __SOLVER_H
 #define __SOLVER_H
 
+#include <sys/time.h>
 #include "wildmac.h"
 
+struct solver_settings {
+    int best_first; // latency search in order of the energy bound
+    int kary; // idle workers evaluate more taus for each bisection step
+    int warm; // bisections start around the taus of solved neighbours
+    int threads; // workers, 0 for one per CPU available
+    int pin; // each worker bound to a CPU of the affinity mask
+};
+typedef struct solver_settings solver_settings_t;
+
+struct context;
+
+void solver_defaults(solver_settings_t *s);
+
 // Currents are given in tens of uA.
 // Time is given in tens of us.
 
-double get_latency_params(double latency, double probability, double *period, 
-        protocol_params_t *params);
-double get_lifetime_params(double lifetime, double probability, double *period,
-        protocol_params_t *params);
+/*
+ * Solve with the settings, memos and workers of ctx; the calls on a 
+ * context run one at a time.
+ */
+double get_latency_params(struct context *ctx, double latency, 
+        double probability, double *period, protocol_params_t *params);
+double get_lifetime_params(struct context *ctx, double lifetime, 
+        double probability, double *period, protocol_params_t *params);
+// Stops the workers kept between the calls on ctx.
+void solver_shutdown(struct context *ctx);
+
+/*
+ * Later calls on ctx give up past the deadline, NULL for none, returning 
+ * the best they found so far or DBL_MAX for nothing; solver_expired tells 
+ * whether the last one did.
+ */
+void solver_set_deadline(struct context *ctx, const struct timeval *deadline);
+int solver_expired(struct context *ctx);
 
 #endif
 